@@ -0,0 +1,233 @@
+#ifndef _ACTIVATION_HPP
+#define _ACTIVATION_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+
+/**
+* Usage: sigmoid(in, out, n[, ActivationPrecision::exact]); // in == out is allowed
+* mul_sigmoid_prime(delta, sigm, n); // delta[i] *= sigm[i]*(1-sigm[i])
+*
+* Activation kernels over contiguous arrays of float or double (e.g. memptr() of a matrix).
+* exact - std::exp for every element.
+* fast - a vectorized exp: x = k*ln2 + r, |r| <= ln2/2, exp(r) by a Taylor polynomial (degree 6 for float,
+*	11 for double, evaluated by Estrin's scheme) and 2^k put directly into the exponent bits. The maximum error of the sigmoid is
+*	1.1e-7 absolute / 3e-7 relative for float (a few ulps, std::exp gives 0.9e-7) and 3e-15 absolute / 1e-14 relative for double,
+*	see bench/activation.cpp.
+*	The widest instruction set of the CPU (AVX-512, AVX2 or the compiler's baseline) is chosen at runtime.
+*/
+
+
+namespace nn{
+
+enum class ActivationPrecision { exact, fast };
+
+// baseline - what the compiler targets by default (SSE2 on x86-64, plain scalar code elsewhere)
+enum class SimdLevel { baseline, avx2, avx512 };
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NN_X86_DISPATCH 1
+#endif
+
+namespace detail{
+
+	template<class T> struct exp_consts;
+
+	template<> struct exp_consts<float>{
+		typedef int32_t int_type;
+		const static int degree = 6;
+		const static int mantissa_bits = 23;
+		const static int exponent_bias = 127;
+		constexpr static float max_arg = 88.0f, min_arg = -87.0f; // 2^k stays a normal number
+		constexpr static float magic = 12582912.0f; // 1.5*2^23, adding it rounds to an integer
+		constexpr static float log2e = 1.44269504088896341f;
+		constexpr static float ln2_hi = 0.693359375f, ln2_lo = -2.12194440e-4f;
+	};
+
+	template<> struct exp_consts<double>{
+		typedef int64_t int_type;
+		const static int degree = 11;
+		const static int mantissa_bits = 52;
+		const static int exponent_bias = 1023;
+		constexpr static double max_arg = 708.0, min_arg = -708.0;
+		constexpr static double magic = 6755399441055744.0; // 1.5*2^52
+		constexpr static double log2e = 1.4426950408889634074;
+		constexpr static double ln2_hi = 6.93147180369123816490e-01, ln2_lo = 1.90821492927058770002e-10;
+	};
+
+	template<class T>
+	constexpr T inv_factorial(int i){
+		return i == 0 ? T(1) : inv_factorial<T>(i-1)/i;
+	}
+
+	// W elements of T in one (GCC extension) vector, and the integers of the same size
+	template<class T, size_t W>
+	struct Vector{
+		typedef T type __attribute__((vector_size(W*sizeof(T))));
+		typedef typename exp_consts<T>::int_type int_type __attribute__((vector_size(W*sizeof(T))));
+	};
+
+	// The largest power of two below n (n > 1), and its logarithm
+	constexpr int split_point(int n, int p = 1){
+		return 2*p < n ? split_point(n, 2*p) : p;
+	}
+
+	constexpr int log2i(int p){
+		return p <= 1 ? 0 : 1 + log2i(p/2);
+	}
+
+	/**
+	* sum r^i/(I+i)! for i = 0..N-1 by Estrin's scheme, unrolled at compile time, pw[k] = r^(2^k).
+	* The dependency chain has log2(N) multiply-adds instead of N with the Horner scheme,
+	* which is what counts for short arrays (e.g. the hidden layer of a single input).
+	*/
+	template<class T, size_t W, int I, int N>
+	struct ExpPolynomial{
+		typedef typename Vector<T, W>::type V;
+
+		__attribute__((always_inline)) static void eval(const V * pw, V & p){
+			const int h = split_point(N);
+			V low, high;
+			ExpPolynomial<T, W, I, h>::eval(pw, low);
+			ExpPolynomial<T, W, I+h, N-h>::eval(pw, high);
+			p = high*pw[log2i(h)] + low;
+		}
+	};
+
+	template<class T, size_t W, int I>
+	struct ExpPolynomial<T, W, I, 1>{
+		typedef typename Vector<T, W>::type V;
+
+		__attribute__((always_inline)) static void eval(const V *, V & p){
+			p = V{} + inv_factorial<T>(I);
+		}
+	};
+
+	/**
+	* One vector of W elements of sigmoid, written with the GCC vector extensions, so that the same code
+	* is compiled for every instruction set: it is always inlined into the functions with the target attributes below.
+	*/
+	template<class T, size_t W>
+	__attribute__((always_inline)) inline void sigmoid_fast_vector(const T * in, T * out){
+		typedef exp_consts<T> C;
+		typedef typename Vector<T, W>::type V;
+		typedef typename Vector<T, W>::int_type VI;
+
+		V x;
+		std::memcpy(&x, in, sizeof(V));
+
+		const V max_arg = V{} + C::max_arg, min_arg = V{} + C::min_arg, magic = V{} + C::magic;
+
+		// exp(t) for t = -x
+		V t = -x;
+		t = t > max_arg ? max_arg : t;
+		t = t < min_arg ? min_arg : t;
+
+		V kf = t*C::log2e + magic;
+		VI k = (VI)kf - (VI)magic;
+		kf -= magic;
+
+		V r = t - kf*C::ln2_hi;
+		r = r - kf*C::ln2_lo;
+
+		V pw[4] = { r, r*r };
+		pw[2] = pw[1]*pw[1];
+		pw[3] = pw[2]*pw[2];
+
+		V p;
+		ExpPolynomial<T, W, 0, C::degree+1>::eval(pw, p);
+
+		V pow2k = (V)((k + C::exponent_bias) << C::mantissa_bits);
+
+		V res = (T)1 / ((T)1 + p*pow2k);
+		std::memcpy(out, &res, sizeof(V));
+	}
+
+	template<class T, size_t W>
+	__attribute__((always_inline)) inline void sigmoid_fast_loop(const T * in, T * out, size_t n){
+		size_t i = 0;
+		for(; i + W <= n; i += W) sigmoid_fast_vector<T, W>(in + i, out + i);
+
+		// The tail through a padded buffer
+		if(i < n){
+			T buf[W] = {};
+			std::memcpy(buf, in + i, (n-i)*sizeof(T));
+			sigmoid_fast_vector<T, W>(buf, buf);
+			std::memcpy(out + i, buf, (n-i)*sizeof(T));
+		}
+	}
+
+	template<class T>
+	inline void sigmoid_fast_baseline(const T * in, T * out, size_t n){
+		sigmoid_fast_loop<T, 16/sizeof(T)>(in, out, n);
+	}
+
+#ifdef NN_X86_DISPATCH
+	template<class T>
+	__attribute__((target("avx2,fma"))) inline void sigmoid_fast_avx2(const T * in, T * out, size_t n){
+		sigmoid_fast_loop<T, 32/sizeof(T)>(in, out, n);
+	}
+
+	template<class T>
+	__attribute__((target("avx512f"))) inline void sigmoid_fast_avx512(const T * in, T * out, size_t n){
+		sigmoid_fast_loop<T, 64/sizeof(T)>(in, out, n);
+	}
+
+	inline SimdLevel detect_simd_level(){
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f")) return SimdLevel::avx512;
+		if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::avx2;
+		return SimdLevel::baseline;
+	}
+#else
+	inline SimdLevel detect_simd_level(){
+		return SimdLevel::baseline;
+	}
+#endif
+
+};
+
+// The widest instruction set supported by the CPU, detected once
+inline SimdLevel simd_level(){
+	static const SimdLevel level = detail::detect_simd_level();
+	return level;
+}
+
+// The fast sigmoid with the given instruction set (the baseline one if the CPU does not support it)
+template<class T>
+inline void sigmoid_fast(const T * in, T * out, size_t n, SimdLevel level){
+#ifdef NN_X86_DISPATCH
+	if(level == SimdLevel::avx512 && simd_level() == SimdLevel::avx512){
+		detail::sigmoid_fast_avx512(in, out, n);
+		return;
+	}
+	if(level != SimdLevel::baseline && simd_level() != SimdLevel::baseline){
+		detail::sigmoid_fast_avx2(in, out, n);
+		return;
+	}
+#endif
+	detail::sigmoid_fast_baseline(in, out, n);
+}
+
+template<class T>
+inline void sigmoid(const T * in, T * out, size_t n, ActivationPrecision precision = ActivationPrecision::fast){
+	if(precision == ActivationPrecision::fast){
+		sigmoid_fast(in, out, n, simd_level());
+		return;
+	}
+
+	for(size_t i = 0; i < n; ++i) out[i] = T(1) / (T(1) + std::exp(-in[i]));
+}
+
+// The derivative of sigmoid as a function of its result, multiplied into delta (a simple loop, the compiler vectorizes it)
+template<class T>
+inline void mul_sigmoid_prime(T * delta, const T * sigm, size_t n){
+	for(size_t i = 0; i < n; ++i) delta[i] *= sigm[i]*(T(1) - sigm[i]);
+}
+
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef _ALLOCATION_COUNTER_HPP
+#define _ALLOCATION_COUNTER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+
+/**
+* Usage: #define NN_COUNT_ALLOCATIONS
+* #include "allocation_counter.hpp" // in one translation unit of the program, before everything else
+* ... nn::allocation_count() ...
+*
+* Counts the heap allocations of the whole program (all threads): the global operator new is replaced
+* and armadillo gets its memory through ARMA_ALIEN_MEM_ALLOC_FUNCTION, so the temporaries of armadillo
+* expressions are counted as well. Meant for the benchmarks and checks (bench/allocations.cpp),
+* a program which does not define NN_COUNT_ALLOCATIONS counts nothing: allocations_counted() is false
+* and allocation_count() stays 0 (so does EpochStats::allocations of GradientDescent, see training_monitor.hpp).
+*
+* Armadillo has to see the macros in every translation unit which uses it, so such a program should consist
+* of this one translation unit (the header must come before <armadillo>).
+*/
+
+
+namespace nn{
+
+namespace detail{
+
+	struct AllocationCounter{
+		std::atomic<size_t> count{0};
+		bool enabled = false;
+	};
+
+	// Constant-initialized, so it can be used by operator new even before the static constructors run
+	inline AllocationCounter & allocation_counter(){
+		static AllocationCounter c;
+		return c;
+	}
+
+	inline void * counted_alloc(size_t bytes){
+		allocation_counter().count.fetch_add(1, std::memory_order_relaxed);
+
+		void * p = nullptr;
+		if(::posix_memalign(&p, 64, bytes ? bytes : 1) != 0) return nullptr;
+		return p;
+	}
+
+};
+
+inline bool allocations_counted(){
+	return detail::allocation_counter().enabled;
+}
+
+// Heap allocations since the start of the program
+inline size_t allocation_count(){
+	return detail::allocation_counter().count.load(std::memory_order_relaxed);
+}
+
+};
+
+
+#ifdef NN_COUNT_ALLOCATIONS
+
+#ifdef ARMA_INCLUDES
+#error "allocation_counter.hpp has to be included before armadillo."
+#endif
+
+#define ARMA_ALIEN_MEM_ALLOC_FUNCTION nn::detail::counted_alloc
+#define ARMA_ALIEN_MEM_FREE_FUNCTION std::free
+
+// The array, nothrow and sized forms call these by default
+void * operator new(size_t bytes){
+	void * p = nn::detail::counted_alloc(bytes);
+	if(!p) throw std::bad_alloc{};
+	return p;
+}
+
+void operator delete(void * p) noexcept {
+	std::free(p);
+}
+
+namespace nn{ namespace detail{
+	const bool allocation_counter_enabled = (allocation_counter().enabled = true);
+}; };
+
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+#include "../activation.hpp"
+#include "common.hpp"
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+
+/**
+* Elements per second and maximum error of the sigmoid kernels (exact and fast with every instruction
+* set the CPU supports), float and double, on an array of the size of the MNIST hidden activations.
+* Usage: bench_activation [elements [repetitions]]
+*
+* Build: make bench, see the Makefile.
+*/
+
+
+namespace{
+
+// Best time of reps runs of f in seconds
+template<class F>
+double best_time(size_t reps, F f){
+	double best = 1e100;
+	for(size_t i = 0; i < reps; ++i){
+		auto start = std::chrono::steady_clock::now();
+		f();
+		best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+template<class T>
+void run(const char * type, size_t n, size_t reps){
+	std::default_random_engine gen(1);
+	std::normal_distribution<double> d(0, 4); // roughly the range of weighed inputs of a trained network
+
+	std::vector<T> in(n), out(n);
+	for(auto && x : in) x = (T)d(gen);
+
+	// Error against long double
+	auto max_error = [&] () {
+		long double ret = 0;
+		for(size_t i = 0; i < n; ++i){
+			long double ref = 1.0L / (1.0L + std::exp(-(long double)in[i]));
+			ret = std::max(ret, std::fabs(ref - out[i]));
+		}
+		return (double)ret;
+	};
+
+	auto report = [&] (const std::string & name, double t) {
+		std::cout << type << " " << name << ": " << n/t/1e6 << " M elements/s, max abs error " << max_error() << std::endl;
+	};
+
+	double t = best_time(reps, [&] () { nn::sigmoid(in.data(), out.data(), n, nn::ActivationPrecision::exact); });
+	report("exact", t);
+
+	for(auto l : { nn::SimdLevel::baseline, nn::SimdLevel::avx2, nn::SimdLevel::avx512 }){
+		if((int)l > (int)nn::simd_level()) break;
+
+		t = best_time(reps, [&] () { nn::sigmoid_fast(in.data(), out.data(), n, l); });
+		report(std::string("fast ") + bench::simd_name(l), t);
+	}
+}
+
+};
+
+
+int main(int argc, char ** argv){
+	size_t n = argc > 1 ? std::stoul(argv[1]) : 120*60000;
+	size_t reps = argc > 2 ? std::stoul(argv[2]) : 5;
+
+	std::cout << "CPU supports " << bench::simd_name(nn::simd_level()) << std::endl;
+
+	run<float>("float", n, reps);
+	run<double>("double", n, reps);
+}
@@ -0,0 +1,91 @@
+#define NN_COUNT_ALLOCATIONS
+#include "../allocation_counter.hpp"
+
+#include "../neural_network.hpp"
+#include "../gradient_descent.hpp"
+#include "../training_data.hpp"
+#include "common.hpp"
+#include <armadillo>
+#include <string>
+#include <iostream>
+#include <vector>
+#include <array>
+#include <memory>
+
+
+/**
+* Checks that a warmed-up epoch of the batched training does no heap allocation at all: the allocations
+* of all the threads (armadillo temporaries included, see allocation_counter.hpp) are counted between
+* the ends of two epochs, i.e. source->start_epoch, every acquire, minibatch and release of the epoch.
+* The first epoch may allocate (the workspaces, the optimizer state, the buffers of the sources), the next
+* ones must not. Several topologies, thread counts and data sources are trained on random data.
+* Prints the allocations of every epoch, the exit code is 1 if a warmed-up one allocated.
+* Usage: bench_allocations
+*
+* Build: make bench, see the Makefile.
+*/
+
+
+namespace{
+
+struct Params{
+	struct CostFunction : nn::CrossEntropyCostFunction{};
+
+	const static size_t epochs = 3;
+	const static size_t batch_size = 10;
+
+	constexpr static double learning_rate = 0.3;
+	constexpr static double regularization_param = 0.1;
+};
+
+// Trains Params::epochs epochs, returns false if an epoch after the first one allocated
+template<class Net>
+bool check(const std::string & name, size_t threads, bool shuffled){
+	std::array<arma::Mat<nn::real>, 2> data = { bench::random_inputs<nn::real>(Net::input_size, 2000, 1),
+		bench::random_outputs<nn::real>(Net::output_size, 2000, 2) };
+
+	nn::GradientDescent<Net, Params> gd;
+	if(shuffled) gd.set_data_source(std::unique_ptr<nn::TrainingDataSource<nn::real>>(new nn::ShuffledDataSource<nn::real>(
+		std::unique_ptr<nn::TrainingDataSource<nn::real>>(new nn::InMemoryDataSource<nn::real>(std::move(data))))));
+	else gd.set_training_data(std::move(data));
+	gd.set_threads(threads);
+
+	// Between the ends of two epochs, i.e. everything train() does in an epoch
+	std::vector<size_t> allocations;
+	allocations.reserve(Params::epochs); // not to count its own allocations
+	size_t last = nn::allocation_count();
+	gd.train([&] (auto &&, size_t) {
+		size_t now = nn::allocation_count();
+		allocations.push_back(now - last);
+		last = now;
+		return false;
+	});
+
+	bool ok = true;
+	std::cout << name << ", " << threads << (threads == 1 ? " thread" : " threads") << (shuffled ? ", shuffled" : "") << ":";
+	for(size_t i = 0; i < allocations.size(); ++i){
+		std::cout << " " << allocations[i];
+		if(i > 0 && allocations[i] != 0) ok = false;
+	}
+	std::cout << (ok ? "" : "  <- allocations in a warmed-up epoch") << std::endl;
+
+	return ok;
+}
+
+};
+
+
+int main(){
+	typedef nn::Network<784, 120, 10> MnistNet;
+	typedef nn::Network<12, 10, 2> VoiceNet; // the fixed-size kernels
+
+	bool ok = true;
+	for(size_t threads : { 1, 2 }){
+		ok = check<MnistNet>("784-120-10", threads, false) && ok;
+		ok = check<VoiceNet>("12-10-2", threads, false) && ok;
+	}
+	ok = check<MnistNet>("784-120-10", 1, true) && ok;
+
+	std::cout << (ok ? "OK" : "FAILED") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+#ifndef _BENCH_COMMON_HPP
+#define _BENCH_COMMON_HPP
+
+#include "../idx_file.hpp"
+#include "../activation.hpp"
+#include <armadillo>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+
+/**
+* Helpers shared by the benchmarks: random and synthetic data, the MNIST files, names for the results.
+*/
+
+
+namespace bench{
+
+inline const char * simd_name(nn::SimdLevel l){
+	switch(l){
+		case nn::SimdLevel::baseline: return "baseline";
+		case nn::SimdLevel::avx2: return "avx2";
+		case nn::SimdLevel::avx512: return "avx512";
+	}
+	return "";
+}
+
+// Uniform in [0,1)
+template<class T>
+arma::Mat<T> random_inputs(size_t rows, size_t cols, unsigned seed){
+	std::default_random_engine gen(seed);
+	std::uniform_real_distribution<double> u(0, 1);
+
+	arma::Mat<T> ret(rows, cols);
+	for(size_t i = 0; i < ret.n_elem; ++i) ret.memptr()[i] = (T)u(gen);
+	return ret;
+}
+
+// Random one-hot columns
+template<class T>
+arma::Mat<T> random_outputs(size_t rows, size_t cols, unsigned seed){
+	std::default_random_engine gen(seed);
+
+	arma::Mat<T> ret(rows, cols, arma::fill::zeros);
+	for(size_t i = 0; i < cols; ++i) ret(gen() % rows, i) = 1;
+	return ret;
+}
+
+const size_t mnist_img_size = 28*28;
+const size_t mnist_digits = 10;
+
+// MNIST images (pixels in [0,1], an image per column) and their labels
+template<class T>
+struct MnistData{
+	arma::Mat<T> images;
+	std::vector<uint8_t> labels;
+
+	// The labels as one-hot columns
+	arma::Mat<T> outputs() const {
+		arma::Mat<T> ret(mnist_digits, labels.size(), arma::fill::zeros);
+		for(size_t i = 0; i < labels.size(); ++i) ret(labels[i], i) = 1;
+		return ret;
+	}
+};
+
+// The first n images (or all of them if there are fewer) of the MNIST files, throws if they cannot be read
+template<class T>
+MnistData<T> read_mnist(const std::string & images_f, const std::string & labels_f, size_t n){
+	nn::IdxFile images(images_f, 3), labels(labels_f, 1);
+	if(images.size() != labels.size()) throw std::runtime_error{"Different numbers of images and labels."};
+	if(images.item_size() != mnist_img_size) throw std::runtime_error{"Not MNIST images."};
+
+	n = std::min(n, images.size());
+
+	MnistData<T> d;
+	d.images.set_size(mnist_img_size, n);
+	nn::convert_items(images, 0, n, T(1)/255, d.images.memptr());
+
+	d.labels.assign(labels.data(), labels.data() + n);
+	for(uint8_t l : d.labels){
+		if(l >= mnist_digits) throw std::runtime_error{"Label out of range."};
+	}
+
+	return d;
+}
+
+// Ten noisy prototypes instead of MNIST, roughly as hard to separate as the real digits
+template<class T>
+MnistData<T> synthetic_mnist(size_t n, unsigned seed){
+	std::default_random_engine gen(seed);
+	std::normal_distribution<double> noise(0, 0.25);
+
+	const arma::Mat<T> prototypes = random_inputs<T>(mnist_img_size, mnist_digits, 1);
+
+	MnistData<T> d;
+	d.images.set_size(mnist_img_size, n);
+	d.labels.resize(n);
+	for(size_t i = 0; i < n; ++i){
+		d.labels[i] = (uint8_t)(gen() % mnist_digits);
+		for(size_t j = 0; j < mnist_img_size; ++j){
+			double pixel = prototypes(j, d.labels[i]) < 0.2 ? 1 : 0;
+			d.images(j, i) = (T)std::min(1.0, std::max(0.0, pixel + noise(gen)));
+		}
+	}
+
+	return d;
+}
+
+};
+
+#endif
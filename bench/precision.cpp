@@ -0,0 +1,91 @@
+#include "../neural_network.hpp"
+#include "../gradient_descent.hpp"
+#include "common.hpp"
+#include <armadillo>
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <array>
+
+
+/**
+* Compares float and double training of the MNIST network: time per epoch and test accuracy.
+* Usage: bench_precision [mnist_dir [epochs [threads]]]
+* Uses the MNIST files from mnist_dir (default "mnist") if they exist, synthetic data otherwise.
+*
+* Build: make bench, see the Makefile.
+*/
+
+
+namespace{
+
+const size_t img_size = bench::mnist_img_size;
+const size_t num_of_digits = bench::mnist_digits;
+
+struct Params{
+	struct CostFunction : nn::CrossEntropyCostFunction{};
+
+	const static size_t epochs = 1000; // the benchmark stops earlier
+	const static size_t batch_size = 10;
+
+	constexpr static double learning_rate = 0.3; // eta
+	constexpr static double regularization_param = 0.1; // lambda
+};
+
+typedef bench::MnistData<double> Data;
+
+template<class T>
+void run(const char * name, const Data & train, const Data & test, size_t epochs, size_t threads){
+	typedef nn::Network<img_size, 120, num_of_digits, T> Net;
+
+	std::array<arma::Mat<T>, 2> data;
+	data[0] = arma::conv_to<arma::Mat<T>>::from(train.images);
+	data[1] = arma::conv_to<arma::Mat<T>>::from(train.outputs());
+
+	const arma::Mat<T> test_images = arma::conv_to<arma::Mat<T>>::from(test.images);
+
+	nn::GradientDescent<Net, Params> gd(std::move(data));
+	gd.set_threads(threads, nn::Parallelism::hogwild);
+
+	auto start = std::chrono::steady_clock::now();
+
+	gd.train([&] (auto && n, size_t epoch_i) {
+		double train_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		auto && res = n->predict(test_images);
+		size_t ok_cnt = 0;
+		for(size_t i = 0; i < res.n_cols; ++i){
+			if(arma::index_max(res.col(i)) == test.labels[i]) ++ok_cnt;
+		}
+
+		std::cout << name << " epoch " << epoch_i << ": " << train_s << " s, accuracy "
+			<< (double)ok_cnt/res.n_cols << std::endl;
+
+		start = std::chrono::steady_clock::now();
+		return epoch_i >= epochs;
+	});
+}
+
+};
+
+
+int main(int argc, char ** argv){
+	std::string dir = argc > 1 ? argv[1] : "mnist";
+	size_t epochs = argc > 2 ? std::stoul(argv[2]) : 3;
+	size_t threads = argc > 3 ? std::stoul(argv[3]) : 1;
+
+	Data train, test;
+	try{
+		train = bench::read_mnist<double>(dir + "/train-images.idx3-ubyte", dir + "/train-labels.idx1-ubyte", 60000);
+		test = bench::read_mnist<double>(dir + "/t10k-images.idx3-ubyte", dir + "/t10k-labels.idx1-ubyte", 10000);
+	}
+	catch(std::exception & e){
+		std::cout << e.what() << " Using synthetic data." << std::endl;
+		train = bench::synthetic_mnist<double>(60000, 2);
+		test = bench::synthetic_mnist<double>(10000, 3);
+	}
+
+	run<double>("double", train, test, epochs, threads);
+	run<float>("float", train, test, epochs, threads);
+}
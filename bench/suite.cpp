@@ -0,0 +1,295 @@
+#include "../neural_network.hpp"
+#include "../gradient_descent.hpp"
+#include "../quantized_network.hpp"
+#include "../voice_processor.hpp"
+#include "common.hpp"
+#include <armadillo>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/**
+* The benchmark suite, for tracking the performance between builds:
+* - forward throughput (Network::predict) at several batch sizes, MNIST and voice topologies
+* - single-input latency (predict(std::array)), p50 and p99
+* - training throughput (one epoch of GradientDescent::train)
+* - VoiceProcessor files per second
+* - model load time (text, binary and quantized files)
+* The results are printed as one JSON object to stdout, progress to stderr.
+* Usage: bench_suite [--quick] [--mnist dir] > results.json
+* Uses the MNIST files from dir (default "mnist") if they exist, synthetic data otherwise.
+*
+* Build: make bench [CONFIG=release|debug] [ARMA_NO_DEBUG=1] [NN_FLOAT=1], see the Makefile.
+*/
+
+
+namespace{
+
+typedef std::chrono::steady_clock Clock;
+
+typedef nn::Network<784, 120, 10> MnistNet;
+typedef nn::Network<12, 10, 2> VoiceNet;
+
+struct TrainParams{
+	struct CostFunction : nn::CrossEntropyCostFunction{};
+
+	const static size_t epochs = 1;
+	const static size_t batch_size = 10;
+
+	constexpr static double learning_rate = 0.3;
+	constexpr static double regularization_param = 0.1;
+};
+
+struct Options{
+	bool quick = false;
+	std::string mnist_dir = "mnist";
+
+	double min_time() const { return quick ? 0.05 : 0.5; } // s per measurement
+	size_t latency_calls() const { return quick ? 2000 : 20000; }
+	size_t train_samples() const { return quick ? 2000 : 20000; }
+	size_t voice_files() const { return quick ? 3 : 20; }
+	double voice_seconds() const { return quick ? 1 : 4; }
+	size_t voice_rate() const { return quick ? 16384 : 44100; }
+};
+
+// Results as the elements of a JSON array
+class Results{
+public:
+	void add(const std::string & benchmark, const std::string & topology, long batch, double value, const std::string & unit){
+		std::ostringstream o;
+		o << "{\"benchmark\": \"" << benchmark << "\", \"topology\": \"" << topology << "\"";
+		if(batch >= 0) o << ", \"batch\": " << batch;
+		o << ", \"value\": " << value << ", \"unit\": \"" << unit << "\"}";
+		items.push_back(o.str());
+
+		std::cerr << benchmark << " " << topology << (batch >= 0 ? " batch " + std::to_string(batch) : "") << ": " << value << " " << unit << std::endl;
+	}
+
+	void print(std::ostream & out, const std::string & data) const {
+		out << "{\n\"build\": " << build() << ",\n\"data\": \"" << data << "\",\n\"results\": [\n";
+		for(size_t i = 0; i < items.size(); ++i) out << "\t" << items[i] << (i + 1 < items.size() ? ",\n" : "\n");
+		out << "]\n}" << std::endl;
+	}
+
+private:
+	std::vector<std::string> items;
+
+	static std::string build(){
+		std::ostringstream o;
+		o << "{\"compiler\": \"" << __VERSION__ << "\"";
+#ifdef __OPTIMIZE__
+		o << ", \"optimized\": true";
+#else
+		o << ", \"optimized\": false";
+#endif
+#ifdef NDEBUG
+		o << ", \"ndebug\": true";
+#else
+		o << ", \"ndebug\": false";
+#endif
+#ifdef ARMA_NO_DEBUG
+		o << ", \"arma_no_debug\": true";
+#else
+		o << ", \"arma_no_debug\": false";
+#endif
+		o << ", \"scalar\": \"" << (sizeof(nn::real) == 4 ? "float" : "double") << "\"";
+		o << ", \"simd\": \"" << bench::simd_name(nn::simd_level()) << "\"}";
+		return o.str();
+	}
+
+};
+
+// How many times per second f can be called (called repeatedly for at least min_time seconds)
+template<class F>
+double rate(double min_time, F f){
+	f(); // warm up (allocations, caches)
+
+	size_t calls = 0;
+	auto start = Clock::now();
+	double t;
+	do{
+		f();
+		++calls;
+		t = std::chrono::duration<double>(Clock::now() - start).count();
+	}while(t < min_time);
+
+	return calls/t;
+}
+
+template<class Net>
+void forward(Results & r, const std::string & topology, const Net & net, const arma::Mat<nn::real> & inputs, const Options & opt){
+	for(size_t batch : { 1, 10, 100, 1000, 10000 }){
+		if(batch > inputs.n_cols) break;
+
+		const arma::Mat<nn::real> in = inputs.cols(0, batch-1);
+		typename Net::Context ctx;
+		double calls = rate(opt.min_time(), [&] () { net.predict(in, ctx); });
+
+		r.add("forward", topology, batch, calls*batch, "samples/s");
+	}
+}
+
+template<class Net>
+void latency(Results & r, const std::string & topology, const Net & net, const arma::Mat<nn::real> & inputs, const Options & opt){
+	std::vector<double> times(opt.latency_calls());
+	std::array<nn::real, Net::input_size> in;
+	volatile nn::real sink = 0;
+
+	for(size_t i = 0; i < times.size(); ++i){
+		const nn::real * col = inputs.colptr(i % inputs.n_cols);
+		std::copy(col, col + Net::input_size, in.begin());
+
+		auto start = Clock::now();
+		auto out = net.predict(in);
+		times[i] = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+		sink = sink + out[0];
+	}
+
+	std::sort(times.begin(), times.end());
+	r.add("latency_p50", topology, 1, times[times.size()/2], "us");
+	r.add("latency_p99", topology, 1, times[times.size()*99/100], "us");
+}
+
+template<class Net>
+void training(Results & r, const std::string & topology, std::array<arma::Mat<nn::real>, 2> data){
+	size_t samples = data[0].n_cols/TrainParams::batch_size*TrainParams::batch_size;
+
+	nn::GradientDescent<Net, TrainParams> gd(std::move(data));
+
+	auto start = Clock::now();
+	gd.train([] (auto &&, size_t) { return false; });
+	double t = std::chrono::duration<double>(Clock::now() - start).count();
+
+	r.add("training", topology, TrainParams::batch_size, samples/t, "samples/s");
+}
+
+// A raw 16-bit mono recording of a voice-like signal (a few harmonics of a 150 Hz tone with noise)
+void write_voice_file(const std::string & file, const Options & opt){
+	std::default_random_engine gen(7);
+	std::normal_distribution<double> noise(0, 500);
+
+	size_t len = (size_t)std::ceil(opt.voice_seconds()*opt.voice_rate());
+	std::vector<int16_t> samples(len);
+	for(size_t i = 0; i < len; ++i){
+		double t = (double)i/opt.voice_rate(), x = noise(gen);
+		for(int h = 1; h <= 4; ++h) x += 6000.0/h*std::sin(2*M_PI*150*h*t);
+		samples[i] = (int16_t)std::max(-32768.0, std::min(32767.0, x));
+	}
+
+	std::ofstream out(file, std::ios::binary);
+	out.write((const char*)samples.data(), samples.size()*sizeof(int16_t));
+}
+
+void voice_processing(Results & r, const std::string & dir, const Options & opt){
+	std::string file = dir + "/voice.raw";
+	write_voice_file(file, opt);
+
+	auto start = Clock::now();
+	double sink = 0;
+	for(size_t i = 0; i < opt.voice_files(); ++i){
+		VoiceProcessor vp(file, opt.voice_seconds(), opt.voice_rate());
+		sink += vp.properties[0];
+	}
+	double t = std::chrono::duration<double>(Clock::now() - start).count();
+
+	r.add("voice_processor", std::to_string((int)opt.voice_seconds()) + "s@" + std::to_string(opt.voice_rate()) + "Hz",
+		-1, opt.voice_files()/t, "files/s");
+	std::remove(file.c_str());
+}
+
+// Average time of load(), in ms
+template<class F>
+double load_time(F load, size_t reps){
+	load();
+	auto start = Clock::now();
+	for(size_t i = 0; i < reps; ++i) load();
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count()/reps;
+}
+
+void model_loading(Results & r, const std::string & dir, MnistNet & net, const arma::Mat<nn::real> & calibration, const Options & opt){
+	const size_t reps = opt.quick ? 3 : 20;
+	std::string text = dir + "/model.txt", binary = dir + "/model.bin", quantized = dir + "/model.q8";
+
+	net.save(text);
+	net.save(binary, nn::ModelFormat::binary);
+	nn::QuantizedNetwork<MnistNet>(net, calibration).save(quantized);
+
+	r.add("load_text", "784-120-10", -1, load_time([&] () { MnistNet n(text); }, reps), "ms");
+	r.add("load_binary", "784-120-10", -1, load_time([&] () { MnistNet n(binary); }, reps), "ms");
+	r.add("load_quantized", "784-120-10", -1, load_time([&] () { nn::QuantizedNetwork<MnistNet> q(quantized); }, reps), "ms");
+
+	for(auto && f : { text, binary, quantized }) std::remove(f.c_str());
+}
+
+};
+
+
+int main(int argc, char ** argv){
+	Options opt;
+	for(int i = 1; i < argc; ++i){
+		std::string a = argv[i];
+		if(a == "--quick") opt.quick = true;
+		else if(a == "--mnist" && i + 1 < argc) opt.mnist_dir = argv[++i];
+		else{
+			std::cerr << "Usage: bench_suite [--quick] [--mnist dir] > results.json" << std::endl;
+			return 1;
+		}
+	}
+
+	// Real images if the MNIST files are there, synthetic ones otherwise
+	std::string data = "synthetic";
+	arma::Mat<nn::real> images;
+	std::array<arma::Mat<nn::real>, 2> mnist_train;
+	try{
+		auto train = bench::read_mnist<nn::real>(opt.mnist_dir + "/train-images.idx3-ubyte", opt.mnist_dir + "/train-labels.idx1-ubyte",
+			opt.train_samples());
+		mnist_train = { train.images, train.outputs() };
+		images = train.images;
+		data = "mnist";
+	}
+	catch(std::exception &){
+		// Drawn separately, train_samples() may be more than the images
+		images = bench::synthetic_mnist<nn::real>(10000, 1).images;
+		auto train = bench::synthetic_mnist<nn::real>(opt.train_samples(), 4);
+		mnist_train = { train.images, train.outputs() };
+	}
+	const arma::Mat<nn::real> voice_inputs = bench::random_inputs<nn::real>(12, 10000, 3);
+
+	std::string tmp_dir = "/tmp";
+	if(const char * t = std::getenv("TMPDIR")) tmp_dir = t;
+	tmp_dir += "/bench_suite." + std::to_string(::getpid());
+	if(::mkdir(tmp_dir.c_str(), 0700) != 0) tmp_dir = ".";
+
+	Results r;
+	MnistNet mnist;
+	VoiceNet voice;
+
+	forward(r, "784-120-10", mnist, images, opt);
+	forward(r, "12-10-2", voice, voice_inputs, opt);
+
+	latency(r, "784-120-10", mnist, images, opt);
+	latency(r, "12-10-2", voice, voice_inputs, opt);
+
+	training<MnistNet>(r, "784-120-10", mnist_train);
+	training<VoiceNet>(r, "12-10-2", { voice_inputs, bench::random_outputs<nn::real>(2, voice_inputs.n_cols, 4) });
+
+	voice_processing(r, tmp_dir, opt);
+	model_loading(r, tmp_dir, mnist, images.cols(0, 999), opt);
+
+	if(tmp_dir != ".") ::rmdir(tmp_dir.c_str());
+
+	r.print(std::cout, data);
+}
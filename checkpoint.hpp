@@ -0,0 +1,145 @@
+#ifndef _CHECKPOINT_HPP
+#define _CHECKPOINT_HPP
+
+#include <armadillo>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "model_file.hpp"
+
+
+/**
+* Checkpoints are binary model files (model_file.hpp): the blocks of the network (w[0], b[1], w[1], ...),
+* then the state arrays of the optimizer and last a 1x2 f64 block {epoch, updates}. So a checkpoint
+* can also be loaded by Network::load as a plain model.
+*
+* AsyncCheckpointWriter is double-buffered: submit() copies the matrices into the pending snapshot
+* (a memcpy into buffers allocated by the first call) and returns, a background thread writes the latest
+* snapshot into a temporary file and renames it over the checkpoint (ModelFileWriter), so the file
+* is always either the previous or the new checkpoint, never a half-written one. If a write is still
+* running when the next snapshot comes, the pending one is replaced, so the training never waits for the disk.
+*/
+
+
+namespace nn{
+
+template<class T>
+class AsyncCheckpointWriter{
+public:
+	typedef arma::Mat<T> mat_type;
+
+	explicit AsyncCheckpointWriter(std::string file): file(std::move(file)) {}
+
+	~AsyncCheckpointWriter(){
+		try{
+			flush();
+		}
+		catch(...){}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		cv.notify_all();
+		if(worker.joinable()) worker.join();
+	}
+
+	AsyncCheckpointWriter(const AsyncCheckpointWriter &) = delete;
+	AsyncCheckpointWriter & operator=(const AsyncCheckpointWriter &) = delete;
+
+	const std::string & path() const {
+		return file;
+	}
+
+	// sizes - the layers of the network, blocks - the matrices in the order of the file, epoch and updates go to the last block.
+	// Rethrows the error of a previous write, if any.
+	void submit(const std::vector<size_t> & sizes, const std::vector<const mat_type *> & blocks, size_t epoch, size_t updates){
+		std::unique_lock<std::mutex> lock(mutex);
+		rethrow();
+
+		pending.sizes = sizes;
+		pending.blocks.resize(blocks.size());
+		for(size_t i = 0; i < blocks.size(); ++i) pending.blocks[i] = *blocks[i]; // no allocation once the sizes are set
+		pending.meta[0] = (double)epoch;
+		pending.meta[1] = (double)updates;
+		has_pending = true;
+
+		if(!worker.joinable()) worker = std::thread([this] () { worker_loop(); });
+
+		lock.unlock();
+		cv.notify_all();
+	}
+
+	// Waits until everything submitted is on the disk, rethrows a write error
+	void flush(){
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] () { return !has_pending && !writing; });
+		rethrow();
+	}
+
+private:
+	struct Snapshot{
+		std::vector<size_t> sizes;
+		std::vector<mat_type> blocks;
+		double meta[2];
+	};
+
+	std::string file;
+
+	Snapshot pending, current; // current is being written by the worker
+	bool has_pending = false, writing = false, quit = false;
+	std::exception_ptr error;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::thread worker;
+
+	void rethrow(){
+		if(error){
+			std::exception_ptr e = error;
+			error = nullptr;
+			std::rethrow_exception(e);
+		}
+	}
+
+	void worker_loop(){
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true){
+			cv.wait(lock, [this] () { return has_pending || quit; });
+			if(!has_pending) return;
+
+			std::swap(pending, current);
+			has_pending = false;
+			writing = true;
+			lock.unlock();
+
+			std::exception_ptr e;
+			try{
+				write(current);
+			}
+			catch(...){
+				e = std::current_exception();
+			}
+
+			lock.lock();
+			writing = false;
+			if(e) error = e;
+			cv.notify_all();
+		}
+	}
+
+	void write(const Snapshot & s) const {
+		ModelFileWriter wr(s.sizes);
+		for(auto && m : s.blocks) wr.add_block(m.memptr(), m.n_rows, m.n_cols);
+		wr.add_block(s.meta, 1, 2);
+		wr.write(file);
+	}
+};
+
+};
+
+#endif
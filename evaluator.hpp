@@ -0,0 +1,220 @@
+#ifndef _EVALUATOR_HPP
+#define _EVALUATOR_HPP
+
+#include <armadillo>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+
+#include "worker_pool.hpp"
+
+
+/**
+* Usage: Evaluator<Network<...>> ev(test_inputs, test_labels, {threads, chunk});
+* EvaluationResult r = ev.evaluate(net);
+* ev.evaluate_async(net, epoch, [] (const EvaluationResult & r) { ... }); ... ev.wait();
+*
+* Classification accuracy and the confusion matrix of a model (Network, QuantizedNetwork or anything
+* with their predict(input, Context &)) on a labelled test set. The test set is processed in chunks
+* of columns, distributed over the threads, each with its own buffers, so the memory taken is
+* threads*chunk*(sizes of all layers) values regardless of the size of the test set.
+* The inputs are either columns of a matrix (used in place) or produced chunk by chunk by a function
+* (e.g. converted from bytes).
+*
+* evaluate_async copies the model and evaluates the copy on a background thread, so the training
+* can continue with the next epoch in the meantime.
+*/
+
+
+namespace nn{
+
+struct EvaluationResult{
+	size_t epoch = 0; // as given to evaluate_async
+	size_t correct = 0, total = 0;
+	size_t classes = 0;
+	std::vector<size_t> confusion; // confusion[actual*classes + predicted]
+
+	double accuracy() const {
+		return total ? (double)correct/total : 0;
+	}
+
+	size_t count(size_t actual, size_t predicted) const {
+		return confusion[actual*classes + predicted];
+	}
+
+	// The confusion matrix, one row per actual class
+	void print_confusion(std::ostream & out) const {
+		for(size_t a = 0; a < classes; ++a){
+			for(size_t p = 0; p < classes; ++p) out << (p ? "\t" : "") << count(a, p);
+			out << std::endl;
+		}
+	}
+};
+
+template<class Model>
+class Evaluator{
+public:
+	typedef typename Model::mat_type mat_type;
+	typedef typename mat_type::elem_type T;
+
+	// Writes the inputs first..first+n-1 as the columns of out (input_size x n)
+	typedef std::function<void(size_t first, size_t n, T * out)> InputFn;
+
+	struct Config{
+		size_t threads;
+		size_t chunk; // inputs per predict call
+	};
+
+	// inputs are only referenced, they have to outlive the evaluator
+	Evaluator(const mat_type & inputs, std::vector<size_t> labels, Config config = Config{1, 1000}):
+			matrix(&inputs), labels(std::move(labels)), config(config) {
+		if(inputs.n_rows != Model::input_size || inputs.n_cols != this->labels.size()) throw std::invalid_argument{"Wrong size of the test data."};
+		init();
+	}
+
+	Evaluator(InputFn inputs, std::vector<size_t> labels, Config config = Config{1, 1000}):
+			input_fn(std::move(inputs)), labels(std::move(labels)), config(config) {
+		init();
+	}
+
+	~Evaluator(){
+		if(worker.joinable()) worker.join();
+	}
+
+	Evaluator(const Evaluator &) = delete;
+	Evaluator & operator=(const Evaluator &) = delete;
+
+	// Waits for a running asynchronous evaluation first
+	EvaluationResult evaluate(const Model & model){
+		wait();
+		return run(model);
+	}
+
+	/**
+	* Copies model (into a snapshot reused by the following calls) and evaluates it on a background thread,
+	* then calls done(result) there. Waits for the previous asynchronous evaluation first,
+	* so at most one runs at a time.
+	*/
+	void evaluate_async(const Model & model, size_t epoch, std::function<void(const EvaluationResult &)> done){
+		wait();
+
+		if(snapshot) *snapshot = model;
+		else snapshot.reset(new Model(model));
+
+		worker = std::thread([this, epoch, done] () {
+			try{
+				EvaluationResult r = run(*snapshot);
+				r.epoch = epoch;
+				done(r);
+				last = std::move(r);
+			}
+			catch(...){
+				error = std::current_exception();
+			}
+		});
+	}
+
+	// Waits for the asynchronous evaluation and rethrows its exception, if any
+	void wait(){
+		if(worker.joinable()) worker.join();
+
+		if(error){
+			std::exception_ptr e = error;
+			error = nullptr;
+			std::rethrow_exception(e);
+		}
+	}
+
+	// The result of the last finished asynchronous evaluation
+	const EvaluationResult & last_result() const {
+		return last;
+	}
+
+	size_t size() const {
+		return labels.size();
+	}
+
+private:
+	const static size_t classes = Model::output_size;
+
+	const mat_type * matrix = nullptr;
+	InputFn input_fn;
+	std::vector<size_t> labels;
+	Config config;
+
+	WorkerPool pool;
+
+	// Buffers of one thread, reused by every evaluation
+	struct ThreadState{
+		std::vector<T> input;
+		typename Model::Context ctx;
+		std::vector<size_t> confusion;
+	};
+	std::vector<ThreadState> states;
+
+	std::unique_ptr<Model> snapshot;
+	std::thread worker;
+	std::exception_ptr error;
+	EvaluationResult last;
+
+	void init(){
+		if(config.chunk == 0) throw std::invalid_argument{"Zero chunk size."};
+		if(std::any_of(labels.begin(), labels.end(), [] (size_t l) { return l >= classes; })) throw std::invalid_argument{"Label out of range."};
+
+		pool.resize(config.threads);
+		states.resize(pool.size());
+	}
+
+	EvaluationResult run(const Model & model){
+		const size_t chunks = (labels.size() + config.chunk - 1)/config.chunk;
+
+		pool.run([&] (size_t thread_i) {
+			ThreadState & s = states[thread_i];
+			s.confusion.assign(classes*classes, 0);
+
+			for(size_t c = thread_i; c < chunks; c += states.size()){
+				size_t first = c*config.chunk;
+				size_t n = std::min(config.chunk, labels.size() - first);
+
+				const T * in;
+				if(matrix){
+					in = matrix->colptr(first);
+				}
+				else{
+					s.input.resize(Model::input_size*config.chunk);
+					input_fn(first, n, s.input.data());
+					in = s.input.data();
+				}
+
+				const mat_type view(const_cast<T*>(in), Model::input_size, n, false, true);
+				const mat_type & res = model.predict(view, s.ctx);
+
+				for(size_t i = 0; i < n; ++i){
+					const T * col = res.colptr(i);
+					size_t predicted = std::max_element(col, col + classes) - col;
+					++s.confusion[labels[first + i]*classes + predicted];
+				}
+			}
+		});
+
+		EvaluationResult r;
+		r.classes = classes;
+		r.total = labels.size();
+		r.confusion.assign(classes*classes, 0);
+		for(auto && s : states){
+			for(size_t i = 0; i < s.confusion.size(); ++i) r.confusion[i] += s.confusion[i];
+		}
+		for(size_t i = 0; i < classes; ++i) r.correct += r.count(i, i);
+
+		return r;
+	}
+};
+
+};
+
+#endif
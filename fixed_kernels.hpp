@@ -0,0 +1,73 @@
+#ifndef _FIXED_KERNELS_HPP
+#define _FIXED_KERNELS_HPP
+
+#include <cstddef>
+
+
+/**
+* Layer kernels for small networks whose sizes are known at compile time (template parameters R - rows
+* of the weight matrix, i.e. the size of the next layer, C - columns, the size of the previous layer).
+* All matrices are column-major arrays, n is the number of inputs (columns). The loops have constant bounds,
+* so the compiler unrolls and vectorizes them, and there is no BLAS call, no size check and no allocation,
+* which is what matters when a layer has a few hundred weights.
+*
+* Network uses them when it has at most NN_FIXED_KERNEL_THRESHOLD weights, the BLAS path otherwise.
+*/
+
+#ifndef NN_FIXED_KERNEL_THRESHOLD
+#define NN_FIXED_KERNEL_THRESHOLD 1024
+#endif
+
+
+namespace nn{
+
+namespace fixed{
+
+	// out (R x n) = W (R x C) * in (C x n) + b, the columns of in and out are in_stride, resp. out_stride apart
+	template<size_t R, size_t C, class T>
+	inline void affine(const T * W, const T * b, const T * in, size_t in_stride, T * out, size_t out_stride, size_t n){
+		for(size_t j = 0; j < n; ++j, in += in_stride, out += out_stride){
+			T acc[R];
+			for(size_t r = 0; r < R; ++r) acc[r] = b[r];
+
+			for(size_t c = 0; c < C; ++c){
+				const T x = in[c];
+				for(size_t r = 0; r < R; ++r) acc[r] += W[c*R + r]*x;
+			}
+
+			for(size_t r = 0; r < R; ++r) out[r] = acc[r];
+		}
+	}
+
+	// out (C x n) = W^T * d, W is R x C, d is R x n
+	template<size_t R, size_t C, class T>
+	inline void mul_transposed(const T * W, const T * d, T * out, size_t n){
+		for(size_t j = 0; j < n; ++j, d += R, out += C){
+			for(size_t c = 0; c < C; ++c){
+				T acc = 0;
+				for(size_t r = 0; r < R; ++r) acc += W[c*R + r]*d[r];
+				out[c] = acc;
+			}
+		}
+	}
+
+	// gw (R x C) = d * a^T, gb (R) = the row sums of d, d is R x n, a is C x n
+	template<size_t R, size_t C, class T>
+	inline void outer_sum(const T * d, const T * a, T * gw, T * gb, size_t n){
+		for(size_t i = 0; i < R*C; ++i) gw[i] = 0;
+		for(size_t r = 0; r < R; ++r) gb[r] = 0;
+
+		for(size_t j = 0; j < n; ++j, d += R, a += C){
+			for(size_t c = 0; c < C; ++c){
+				const T x = a[c];
+				for(size_t r = 0; r < R; ++r) gw[c*R + r] += d[r]*x;
+			}
+			for(size_t r = 0; r < R; ++r) gb[r] += d[r];
+		}
+	}
+
+};
+
+};
+
+#endif
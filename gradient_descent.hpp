@@ -13,9 +13,19 @@
 #include <fstream>
 #include <algorithm>
 #include <utility>
+#include <memory>
+#include <stdexcept>
+#include <atomic>
+#include <limits>
 
 
 #include "neural_network.hpp"
+#include "worker_pool.hpp"
+#include "training_data.hpp"
+#include "optimizers.hpp"
+#include "training_monitor.hpp"
+#include "checkpoint.hpp"
+#include "allocation_counter.hpp"
 
 
 // [1] http://neuralnetworksanddeeplearning.com
@@ -27,18 +37,90 @@ namespace nn{
 
 struct CrossEntropyCostFunction{
 	// a - output, y - expected output
-	inline static double f(arma::mat a, arma::mat y){
-		return arma::accu(-((y % arma::trunc_log(a)) + ((1-y) % arma::trunc_log(1-a))));
+	// Element by element, so that no temporary matrix is allocated
+	template<class T>
+	inline static T f(const arma::Mat<T> & a, const arma::Mat<T> & y){
+		const T * pa = a.memptr(), * py = y.memptr();
+		T sum = 0;
+		for(size_t i = 0; i < a.n_elem; ++i){
+			sum -= py[i]*trunc_log(pa[i]) + (1-py[i])*trunc_log(1-pa[i]);
+		}
+		return sum;
 	}
 	// See [1]
-	inline static arma::mat delta(arma::mat a, arma::mat y, arma::mat){
-		return std::move(a-y);
+	template<class T>
+	inline static arma::Mat<T> delta(const arma::Mat<T> & a, const arma::Mat<T> & y, const arma::Mat<T> &){
+		return a-y;
+	}
+	// The same, written into out, which already has the right size (so nothing is allocated)
+	template<class T>
+	inline static void delta(arma::Mat<T> & out, const arma::Mat<T> & a, const arma::Mat<T> & y, const arma::Mat<T> &){
+		T * po = out.memptr();
+		const T * pa = a.memptr(), * py = y.memptr();
+		for(size_t i = 0; i < out.n_elem; ++i) po[i] = pa[i] - py[i];
+	}
+
+private:
+	// As arma::trunc_log
+	template<class T>
+	inline static T trunc_log(T x){
+		if(x <= 0) return std::log(std::numeric_limits<T>::min());
+		if(std::isinf(x)) return std::log(std::numeric_limits<T>::max());
+		return std::log(x);
 	}
 };
 
+/**
+* Backpropagation engines, chosen by the Backprop member of the Params policy
+* (if there is none, BatchedBackprop is used).
+* PerSampleBackprop sums one outer product per sample of the minibatch,
+* BatchedBackprop computes the whole gradient of a layer as one matrix product
+* delta*A^T and the bias gradient as row sums of delta. Both give the same numbers
+* up to rounding, the batched one is several times faster.
+*/
+struct PerSampleBackprop{};
+struct BatchedBackprop{};
+
+namespace detail{
+
+	template<class...> struct voider { typedef void type; };
+
+	// Params::Backprop if it exists, BatchedBackprop otherwise
+	template<class P, class = void> struct backprop_of { typedef BatchedBackprop type; };
+	template<class P> struct backprop_of<P, typename voider<typename P::Backprop>::type> {
+		typedef typename P::Backprop type;
+	};
+
+	// Params::Optimizer and Params::Schedule (see optimizers.hpp), Sgd and ConstantRate if there are none
+	template<class P, class = void> struct optimizer_of { typedef Sgd type; };
+	template<class P> struct optimizer_of<P, typename voider<typename P::Optimizer>::type> {
+		typedef typename P::Optimizer type;
+	};
+
+	template<class P, class = void> struct schedule_of { typedef ConstantRate type; };
+	template<class P> struct schedule_of<P, typename voider<typename P::Schedule>::type> {
+		typedef typename P::Schedule type;
+	};
+
+};
+
+/**
+* How GradientDescent uses more threads (see GradientDescent::set_threads):
+* synchronous - every minibatch is split into one shard of columns per thread and the gradients
+*	of the shards are summed in a fixed order, so the result does not depend on timing and
+*	equals the single-threaded one up to rounding. Pays off only for large batch sizes.
+* hogwild - every thread processes its own minibatches and updates the shared weights without
+*	any locking (see "Hogwild!", Niu et al.). Much better scaling, but not deterministic.
+* Both apply only to the batched backpropagation engine.
+*/
+enum class Parallelism { synchronous, hogwild };
+
 struct DefaultParams{
 
 	struct CostFunction : CrossEntropyCostFunction {};
+	struct Backprop : BatchedBackprop {};
+	struct Optimizer : Sgd {};
+	struct Schedule : ConstantRate {};
 
 	const static size_t epochs = 30;
 	const static size_t batch_size = 10;
@@ -52,8 +134,15 @@ struct DefaultParams{
 template<class Net, class Params>
 class GradientDescent{
 
-	// {input/output}_size * %_data_size * 2 (two for input/output)
-	std::array<arma::mat, 2> training_data;
+	// The scalar type of the network, used also for the training data and all the buffers
+	typedef typename Net::scalar_type T;
+	typedef typename Net::mat_type mat_type;
+	typedef typename Net::vec_type vec_type;
+
+	typedef typename detail::optimizer_of<Params>::type Optimizer;
+	typedef typename detail::schedule_of<Params>::type Schedule;
+
+	std::unique_ptr<TrainingDataSource<T>> source;
 
 	size_t data_size; // training data size
 	static const size_t input_size = Net::input_size;
@@ -66,14 +155,22 @@ public:
 	
 	GradientDescent() = default;
 
-	GradientDescent(std::array<arma::mat, 2> tr_data):
-					training_data(std::move(tr_data)) {
-		data_size = (size_t)training_data[0].n_cols;
+	// {input/output}_size * %_data_size * 2 (two for input/output)
+	GradientDescent(std::array<mat_type, 2> tr_data){
+		set_training_data(std::move(tr_data));
 	}
 
-	void set_training_data(std::array<arma::mat, 2> tr_data){
-		training_data = std::move(tr_data);
-		data_size = (size_t)training_data[0].n_cols;
+	void set_training_data(std::array<mat_type, 2> tr_data){
+		set_data_source(std::unique_ptr<TrainingDataSource<T>>(new InMemoryDataSource<T>(std::move(tr_data))));
+	}
+
+	// Any other source of the training data, e.g. StreamingDataSource for data sets larger than the memory
+	void set_data_source(std::unique_ptr<TrainingDataSource<T>> src){
+		if(src->input_size() != input_size || src->output_size() != output_size){
+			throw std::invalid_argument{"The training data do not fit the network."};
+		}
+		source = std::move(src);
+		data_size = source->size();
 	}
 
 	// F after_epoch is a function which takes a pointer to the network and the number of the epoch
@@ -81,44 +178,478 @@ public:
 	// compute the success rate on test data after each epoch.
 	template<typename F>
 	void train(F after_epoch){
+		prepare_workspaces();
+		prepare_optimizer();
+
+		for(size_t ep = first_epoch; ep <= Params::epochs; ++ep){
+			detail::Stopwatch epoch_sw(timed());
+			size_t reallocations = workspace_reallocations();
+			reset_stats();
 
-		for(size_t ep = 1; ep <= Params::epochs; ++ep){
 			err = 0;
+			eta = detail::scheduled_rate<Schedule>(Params::learning_rate, ep, Params::epochs, Schedule{});
+
+			const size_t allocations = allocation_count();
+			source->start_epoch(Params::batch_size);
 
-			for(size_t i = 0; i < data_size/Params::batch_size; ++i){
-				process_mini_batch(i);
+			if(hogwild()){
+				process_epoch_hogwild();
 			}
+			else{
+				for(size_t i = 0; i < data_size/Params::batch_size; ++i){
+					process_mini_batch(i);
+				}
+			}
+			const size_t epoch_allocations = allocation_count() - allocations;
+
+			double checkpoint_time = 0, callback_time = 0, wall_time = 0;
+			detail::Stopwatch sw(timed());
+			if(checkpointer && (ep % checkpoint_every == 0 || ep == Params::epochs)) checkpoint(ep);
+			sw.lap(checkpoint_time);
+
+			bool stop = after_epoch(&n, ep);
+			sw.lap(callback_time);
+			epoch_sw.lap(wall_time);
 
-			// std::cout << "Avg err: " << err/data_size << std::endl;
+			if(monitor) report(ep, wall_time, checkpoint_time, callback_time, epoch_allocations, workspace_reallocations() - reallocations);
 
-			if(after_epoch(&n, ep))break;
+			if(stop)break;
 		}
+
+		first_epoch = 1;
+
+		// The last checkpoint is on the disk when the training returns
+		if(checkpointer) checkpointer->flush();
 	}
 
+	/**
+	* Saves a checkpoint (see checkpoint.hpp) of the network and the optimizer into file after every
+	* every-th epoch and after the last one. The state is copied into a snapshot at the end of the epoch
+	* and written by a background thread while the training goes on. An empty file turns it off.
+	*/
+	void set_checkpointing(const std::string & file, size_t every = 1){
+		if(every == 0) throw std::invalid_argument{"Zero checkpoint interval."};
+
+		checkpointer.reset();
+		if(!file.empty()) checkpointer.reset(new AsyncCheckpointWriter<T>(file));
+		checkpoint_every = every;
+	}
+
+	/**
+	* Restores the network and the optimizer from a checkpoint, the next train() continues with the epoch
+	* after the saved one (with its learning rate). Returns the number of the saved epoch.
+	* The order of the samples of a shuffled data source is not restored, the epochs after resuming
+	* get other permutations than they would have without the interruption.
+	*/
+	size_t resume(const std::string & file){
+		MappedModelFile f(file);
+		f.verify(); // all of it is read anyway
+
+		const size_t net_blocks = 2*(Net::layers_n-1), k = detail::state_arrays(Optimizer{});
+		if(f.blocks_n() != net_blocks*(1 + k) + 1) throw std::runtime_error{"The checkpoint does not fit the network or the optimizer."};
+
+		const double * meta = f.data<double>(f.blocks_n()-1, 1, 2);
+		size_t epoch = (size_t)meta[0];
+
+		// Checks the topology and the optimizer state before anything is changed
+		for(size_t j = 0; j < k; ++j){
+			for(size_t i = 0; i < n.w.size(); ++i){
+				f.data<T>(net_blocks*(1+j) + 2*i, n.w[i].n_rows, n.w[i].n_cols);
+				f.data<T>(net_blocks*(1+j) + 2*i + 1, n.b[i+1].n_elem, 1);
+			}
+		}
+
+		n.load(file);
+
+		prepare_optimizer();
+		for(size_t j = 0; j < k; ++j){
+			for(size_t i = 0; i < n.w.size(); ++i){
+				const T * w = f.data<T>(net_blocks*(1+j) + 2*i, n.w[i].n_rows, n.w[i].n_cols);
+				const T * b = f.data<T>(net_blocks*(1+j) + 2*i + 1, n.b[i+1].n_elem, 1);
+				std::copy(w, w + n.w[i].n_elem, opt_w[j][i].memptr());
+				std::copy(b, b + n.b[i+1].n_elem, opt_b[j][i+1].memptr());
+			}
+		}
+
+		updates = (size_t)meta[1];
+		first_epoch = epoch + 1;
+		return epoch;
+	}
+
+	// Called with the statistics of every epoch (see training_monitor.hpp), an empty function turns the measuring off
+	void set_monitor(TrainingMonitor m){
+		monitor = std::move(m);
+	}
+
+
+	// Trains with the given number of threads (1 by default), see Parallelism
+	void set_threads(size_t threads, Parallelism mode = Parallelism::synchronous){
+		pool.resize(threads);
+		parallelism = mode;
+	}
+
+	size_t threads() const {
+		return pool.size();
+	}
+
+	// How many times the buffers of the training workspaces had to be (re)allocated, it is constant after
+	// the first minibatch of the first epoch. Only these buffers are watched, not the temporaries of a step
+	// (e.g. of armadillo expressions or the per-sample engine).
+	size_t workspace_reallocations() const {
+		size_t ret = 0;
+		for(auto && w : ws) ret += w.reallocations;
+		return ret;
+	}
 
 private:
 
 	double err;
 
+	double eta = Params::learning_rate; // the learning rate of the current epoch
+
+	// State of the optimizer, opt_w[k][i] for w[i], opt_b[k][i] for b[i], k < state_arrays(Optimizer)
+	std::vector<mat_type> opt_w[2];
+	std::vector<vec_type> opt_b[2];
+	std::atomic<size_t> updates{0}; // for the bias correction of Adam
+
+	TrainingMonitor monitor;
+
+	std::unique_ptr<AsyncCheckpointWriter<T>> checkpointer;
+	size_t checkpoint_every = 1;
+	size_t first_epoch = 1; // set by resume()
+	std::vector<const mat_type *> checkpoint_blocks;
+
+	WorkerPool pool;
+	Parallelism parallelism = Parallelism::synchronous;
+
+	/**
+	* Buffers for one training step of the batched engine, sized once from the topology
+	* and Params::batch_size. Indexed by layer like Network::a and Network::z,
+	* a[0] and z[0] are unused because the input is a view of the training data.
+	*/
+	struct Workspace{
+		std::vector<mat_type> a, z, delta;
+		std::vector<vec_type> nabla_b; // nabla_b[0] unused
+		std::vector<mat_type> nabla_w;
+
+		double err = 0; // cost of the columns processed by this workspace
+		size_t reallocations = 0;
+
+		// Time spent by the thread of this workspace in the current epoch, only measured with a monitor
+		PhaseTimes times;
+		std::vector<double> layer_forward, layer_backward; // per layer (of weights)
+
+		void prepare(const Net & net, size_t cols){
+			a.resize(Net::layers_n); z.resize(Net::layers_n); delta.resize(Net::layers_n);
+			nabla_b.resize(Net::layers_n);
+			nabla_w.resize(Net::layers_n-1);
+
+			for(size_t i = 1; i < Net::layers_n; ++i){
+				fit(a[i], net.sizes[i], cols);
+				fit(z[i], net.sizes[i], cols);
+				fit(delta[i], net.sizes[i], cols);
+				fit(nabla_b[i], net.sizes[i], 1);
+				fit(nabla_w[i-1], net.sizes[i], net.sizes[i-1]);
+			}
+			layer_forward.resize(Net::layers_n-1);
+			layer_backward.resize(Net::layers_n-1);
+
+			remember_buffers();
+		}
+
+		// Counts the buffers which armadillo has reallocated since the last call
+		void check(){
+			size_t k = 0;
+			for(size_t i = 1; i < Net::layers_n; ++i){
+				for(const T * p : { a[i].memptr(), z[i].memptr(), delta[i].memptr(),
+							nabla_b[i].memptr(), nabla_w[i-1].memptr() }){
+					if(p != buffers[k++]) ++reallocations;
+				}
+			}
+
+			if(reallocations != checked_reallocations){
+				checked_reallocations = reallocations;
+				remember_buffers();
+			}
+		}
+
+	private:
+		std::vector<const T *> buffers;
+		size_t checked_reallocations = 0;
+
+		void fit(mat_type & m, size_t rows, size_t cols){
+			if(m.n_rows == rows && m.n_cols == cols) return;
+
+			m.set_size(rows, cols);
+			++reallocations;
+		}
+
+		void remember_buffers(){
+			buffers.clear();
+			for(size_t i = 1; i < Net::layers_n; ++i){
+				for(const T * p : { a[i].memptr(), z[i].memptr(), delta[i].memptr(),
+							nabla_b[i].memptr(), nabla_w[i-1].memptr() }){
+					buffers.push_back(p);
+				}
+			}
+			checked_reallocations = reallocations;
+		}
+	};
+
+	// One workspace per thread (per shard of the minibatch in the synchronous mode)
+	std::vector<Workspace> ws;
+
+	bool timed() const {
+		return (bool)monitor;
+	}
+
+	void reset_stats(){
+		for(auto && w : ws){
+			w.times = PhaseTimes{};
+			std::fill(w.layer_forward.begin(), w.layer_forward.end(), 0.0);
+			std::fill(w.layer_backward.begin(), w.layer_backward.end(), 0.0);
+		}
+	}
+
+	// Hands a copy of the network and the optimizer state to the checkpoint writer
+	void checkpoint(size_t epoch){
+		const size_t k = detail::state_arrays(Optimizer{});
+
+		checkpoint_blocks.clear();
+		for(size_t j = 0; j <= k; ++j){
+			for(size_t i = 0; i < n.w.size(); ++i){
+				checkpoint_blocks.push_back(j ? &opt_w[j-1][i] : &n.w[i]);
+				checkpoint_blocks.push_back(j ? &opt_b[j-1][i+1] : &n.b[i+1]);
+			}
+		}
+
+		checkpointer->submit(std::vector<size_t>(n.sizes.begin(), n.sizes.end()), checkpoint_blocks, epoch, updates);
+	}
+
+	void report(size_t epoch, double wall_time, double checkpoint_time, double callback_time, size_t allocations, size_t reallocations){
+		EpochStats s;
+		s.epoch = epoch;
+		s.samples = data_size/Params::batch_size*Params::batch_size;
+		s.threads = pool.size();
+		s.eta = eta;
+		s.loss = s.samples ? err/s.samples : 0;
+		s.wall_time = wall_time;
+		s.allocations_counted = allocations_counted();
+		s.allocations = allocations;
+		s.workspace_reallocations = reallocations;
+
+		for(auto && w : ws) s.phases += w.times;
+		s.phases.checkpoint = checkpoint_time;
+		s.phases.callback = callback_time;
+
+		s.layers.resize(Net::layers_n-1);
+		for(size_t i = 0; i < s.layers.size(); ++i){
+			LayerStats & l = s.layers[i];
+			l.rows = n.sizes[i+1];
+			l.cols = n.sizes[i];
+
+			// One product forward, the gradient of the weights and (except the first layer) the delta of the previous one backward
+			double product = 2.0*l.rows*l.cols*s.samples;
+			l.forward_flops = product;
+			l.backward_flops = (i ? 2 : 1)*product;
+
+			for(auto && w : ws){
+				l.forward_time += w.layer_forward[i];
+				l.backward_time += w.layer_backward[i];
+			}
+		}
+
+		monitor(s);
+	}
+
+	bool hogwild() const {
+		return pool.size() > 1 && parallelism == Parallelism::hogwild &&
+			std::is_base_of<BatchedBackprop, typename detail::backprop_of<Params>::type>::value;
+	}
+
+	// The number of shards a minibatch is split into
+	size_t shards() const {
+		// size_t(...) makes a copy, std::min would bind (odr-use) the static member
+		return hogwild() ? 1 : std::min(pool.size(), size_t(Params::batch_size));
+	}
+
+	size_t shard_begin(size_t shard_i) const {
+		return shard_i*Params::batch_size/shards();
+	}
+
+	void prepare_workspaces(){
+		if(hogwild()){
+			ws.resize(pool.size());
+			for(auto && w : ws) w.prepare(n, Params::batch_size);
+		}
+		else{
+			ws.resize(shards());
+			for(size_t i = 0; i < ws.size(); ++i){
+				ws[i].prepare(n, shard_begin(i+1) - shard_begin(i));
+			}
+		}
+	}
+
 	// See [1]
 
 	void process_mini_batch(size_t minibatch_i){
-		size_t start = Params::batch_size*minibatch_i;
-		arma::mat inp = training_data[0].cols(start, start+Params::batch_size-1);
-		arma::mat outp = training_data[1].cols(start, start+Params::batch_size-1);
+		process_mini_batch(minibatch_i, typename detail::backprop_of<Params>::type{});
+	}
+
+	// Works only with the preallocated workspaces, so after the first minibatch none of them is reallocated
+	void process_mini_batch(size_t minibatch_i, const BatchedBackprop &){
+		detail::Stopwatch sw(timed());
+		const TrainingBatch<T> batch = source->acquire(minibatch_i);
+		sw.lap(ws[0].times.data);
+
+		if(ws.size() == 1){
+			ws[0].err = compute_gradient(ws[0], batch, 0, Params::batch_size);
+			sw.restart();
+		}
+		else{
+			pool.run([this, &batch] (size_t shard_i) {
+				if(shard_i >= ws.size()) return;
+
+				size_t begin = shard_begin(shard_i);
+				ws[shard_i].err = compute_gradient(ws[shard_i], batch, begin, shard_begin(shard_i+1) - begin);
+			});
+			sw.restart(); // the shards timed themselves
+
+			// Deterministic reduction, always in the order of the shards
+			for(size_t i = 1; i < ws.size(); ++i){
+				for(size_t lay = 1; lay < Net::layers_n; ++lay){
+					ws[0].nabla_b[lay] += ws[i].nabla_b[lay];
+					ws[0].nabla_w[lay-1] += ws[i].nabla_w[lay-1];
+				}
+			}
+		}
+		sw.lap(ws[0].times.backward); // the reduction
+
+		source->release(minibatch_i);
+		sw.lap(ws[0].times.data);
+
+		for(auto && w : ws) err += w.err;
+
+		update_weights(ws[0].nabla_b, ws[0].nabla_w);
+		sw.lap(ws[0].times.update);
+
+		for(auto && w : ws) w.check();
+	}
+
+	// Every thread takes every threads()-th minibatch and updates the weights as soon as it has the gradient,
+	// without locking. Threads may therefore read weights which are just being updated by another thread.
+	void process_epoch_hogwild(){
+		size_t batches = data_size/Params::batch_size;
+
+		pool.run([this, batches] (size_t thread_i) {
+			Workspace & w = ws[thread_i];
+			double thread_err = 0;
+
+			for(size_t i = thread_i; i < batches; i += ws.size()){
+				detail::Stopwatch sw(timed());
+				const TrainingBatch<T> batch = source->acquire(i);
+				sw.lap(w.times.data);
+
+				thread_err += compute_gradient(w, batch, 0, Params::batch_size);
+				sw.restart();
+
+				source->release(i);
+				sw.lap(w.times.data);
+
+				update_weights(w.nabla_b, w.nabla_w);
+				sw.lap(w.times.update);
+				w.check();
+			}
+
+			w.err = thread_err;
+		});
+
+		for(auto && w : ws) err += w.err;
+	}
+
+	// Forward and backward pass of the batched engine over the columns start..start+cols-1 of the minibatch.
+	// Leaves the gradient (summed over the columns) in w.nabla_b, w.nabla_w and returns the cost.
+	double compute_gradient(Workspace & w, const TrainingBatch<T> & batch, size_t start, size_t cols) const {
+		const size_t last = Net::layers_n-1;
+
+		// Non-owning views of the columns of the minibatch
+		const mat_type inp(const_cast<T*>(batch.input + start*input_size), input_size, cols, false, true);
+		const mat_type outp(const_cast<T*>(batch.output + start*output_size), output_size, cols, false, true);
+
+		detail::Stopwatch sw(timed());
+		n.forward(inp, w.a, &w.z, timed() ? w.layer_forward.data() : nullptr);
+		sw.lap(w.times.forward);
+
+		Params::CostFunction::delta(w.delta[last], w.a[last], outp, w.z[last]);
+
+		backward(w, inp, std::integral_constant<bool, Net::fixed_kernels>{});
+
+		double cost = Params::CostFunction::f(w.a[last], outp);
+		sw.lap(w.times.backward);
+
+		return cost;
+	}
+
+	// Backpropagates w.delta[last] into all the gradients, one GEMM per layer instead of one outer product per sample
+	void backward(Workspace & w, const mat_type & inp, std::false_type) const {
+		const size_t last = Net::layers_n-1;
+		detail::Stopwatch sw(timed());
+
+		for(size_t lay = last; lay > 0; --lay){
+			if(lay != last){
+				w.delta[lay] = n.w[lay].t() * w.delta[lay+1];
+				mul_sigmoid_prime(w.delta[lay].memptr(), w.a[lay].memptr(), w.delta[lay].n_elem);
+				sw.lap(w.layer_backward[lay]);
+			}
+
+			const mat_type & prev = (lay == 1) ? inp : w.a[lay-1];
+
+			w.nabla_b[lay] = arma::sum(w.delta[lay], 1);
+			w.nabla_w[lay-1] = w.delta[lay]*prev.t();
+			sw.lap(w.layer_backward[lay-1]);
+		}
+	}
+
+	// The same for small networks with the kernels with compile-time sizes
+	void backward(Workspace & w, const mat_type & inp, std::true_type) const {
+		const size_t is = Net::input_size, hs = Net::hidden_size, os = Net::output_size;
+		const size_t cols = inp.n_cols;
+		detail::Stopwatch sw(timed());
+
+		fixed::outer_sum<os, hs>(w.delta[2].memptr(), w.a[1].memptr(), w.nabla_w[1].memptr(), w.nabla_b[2].memptr(), cols);
+
+		fixed::mul_transposed<os, hs>(n.w[1].memptr(), w.delta[2].memptr(), w.delta[1].memptr(), cols);
+		mul_sigmoid_prime(w.delta[1].memptr(), w.a[1].memptr(), hs*cols);
+		sw.lap(w.layer_backward[1]);
+
+		fixed::outer_sum<hs, is>(w.delta[1].memptr(), inp.memptr(), w.nabla_w[0].memptr(), w.nabla_b[1].memptr(), cols);
+		sw.lap(w.layer_backward[0]);
+	}
+
+	// Only the phases are timed here, not the layers
+	void process_mini_batch(size_t minibatch_i, const PerSampleBackprop &){
+		PhaseTimes & times = ws[0].times;
+		detail::Stopwatch sw(timed());
+
+		const TrainingBatch<T> batch = source->acquire(minibatch_i);
+		mat_type inp(batch.input, input_size, Params::batch_size);
+		mat_type outp(batch.output, output_size, Params::batch_size);
+		source->release(minibatch_i);
+		sw.lap(times.data);
 
 		n.feed_forward(inp);
+		sw.lap(times.forward);
 
-		std::vector<arma::mat> nabla_b(Net::layers_n);
-		std::vector<arma::cube> nabla_w(Net::layers_n);
+		std::vector<mat_type> nabla_b(Net::layers_n);
+		std::vector<arma::Cube<T>> nabla_w(Net::layers_n);
 
-		arma::mat delta = Params::CostFunction::delta(n.a[n.layers_n-1], outp, n.z[n.layers_n-1]);
+		mat_type delta = Params::CostFunction::delta(n.a[n.layers_n-1], outp, n.z[n.layers_n-1]);
 
 
 		err+=Params::CostFunction::f(n.a[n.layers_n-1], outp);
 
 		nabla_b[n.layers_n-1] = delta;
-		nabla_w[n.layers_n-1] = arma::cube(n.sizes[n.layers_n-1], n.sizes[n.layers_n-2], delta.n_cols);
+		nabla_w[n.layers_n-1] = arma::Cube<T>(n.sizes[n.layers_n-1], n.sizes[n.layers_n-2], delta.n_cols);
 
 		for(size_t i = 0; i < delta.n_cols; ++i){
 			nabla_w[n.layers_n-1].slice(i) = delta.col(i)*(n.a[n.layers_n-2].col(i).t());
@@ -126,13 +657,11 @@ private:
 
 		// Yes, this runs only once for three-layer network
 		for(size_t lay = 2; lay < n.layers_n; ++lay){
-			arma::mat sp = n.a[n.layers_n-2];
-			sp.transform([] (double x) { return sigmoid_prime(x); });
-
-			delta = ((n.w[n.layers_n-lay].t()) * delta) % sp;
+			delta = (n.w[n.layers_n-lay].t()) * delta;
+			mul_sigmoid_prime(delta.memptr(), n.a[n.layers_n-lay].memptr(), delta.n_elem);
 			nabla_b[n.layers_n-lay] = delta;
 
-			nabla_w[n.layers_n-lay] = arma::cube(n.sizes[n.layers_n-lay], n.sizes[n.layers_n-lay-1], delta.n_cols);
+			nabla_w[n.layers_n-lay] = arma::Cube<T>(n.sizes[n.layers_n-lay], n.sizes[n.layers_n-lay-1], delta.n_cols);
 
 			for(size_t i = 0; i < delta.n_cols; ++i){
 				nabla_w[n.layers_n-lay].slice(i) = delta.col(i)*(n.a[n.layers_n-lay-1].col(i).t());
@@ -140,33 +669,64 @@ private:
 
 		}
 
-		std::vector<arma::vec> nabla_b_cum(nabla_b.size());
+		std::vector<vec_type> nabla_b_cum(nabla_b.size());
 		std::transform(nabla_b.begin()+1, nabla_b.end(), nabla_b_cum.begin()+1, [] ( auto && mat ) { return arma::sum(mat, 1 ); });
 
 
-		std::vector<arma::mat> nabla_w_cum(nabla_w.size()-1);
+		std::vector<mat_type> nabla_w_cum(nabla_w.size()-1);
 		std::transform(nabla_w.begin()+1, nabla_w.end(), nabla_w_cum.begin(), [] ( auto && cube ) { return arma::sum(cube, 2 ); });
+		sw.lap(times.backward);
 
 
 
-		auto nabb = nabla_b_cum.begin()+1;
-		for(auto b = n.b.begin()+1; b != n.b.end(); ++b, ++nabb){
-			*b -= (Params::learning_rate/Params::batch_size)*(*nabb);
-		}
+		update_weights(nabla_b_cum, nabla_w_cum);
+		sw.lap(times.update);
+	}
 
-		auto nabw = nabla_w_cum.begin();
-		for(auto w = n.w.begin(); w != n.w.end(); ++w, ++nabw){
-			*w = (1-Params::learning_rate*(Params::regularization_param/data_size))*(*w)
-					-(Params::learning_rate/Params::batch_size)*(*nabw);
+	// Allocated (zeroed) once, kept by the following calls of train()
+	void prepare_optimizer(){
+		for(size_t k = 0; k < detail::state_arrays(Optimizer{}); ++k){
+			if(opt_w[k].size() == n.w.size()) continue;
+
+			opt_w[k].resize(n.w.size());
+			opt_b[k].resize(n.b.size());
+			for(size_t i = 0; i < n.w.size(); ++i) opt_w[k][i].zeros(n.w[i].n_rows, n.w[i].n_cols);
+			for(size_t i = 1; i < n.b.size(); ++i) opt_b[k][i].zeros(n.b[i].n_elem);
 		}
-	
 	}
 
-	// The derivative of sigmoid function (as a function of the result of the sigmoid function for efficiency reasons)
-	static double sigmoid_prime(double sigm){
-		return sigm*(1-sigm);
+	template<class M>
+	static T * state(std::vector<M> & s, size_t i){
+		return s.empty() ? nullptr : s[i].memptr();
 	}
 
+	// nabla_b[i] is the gradient of b[i] (nabla_b[0] is unused), nabla_w[i] the gradient of w[i],
+	// both summed over the minibatch. One fused pass of the optimizer over every matrix.
+	void update_weights(const std::vector<vec_type> & nabla_b, const std::vector<mat_type> & nabla_w){
+		detail::UpdateStep<T> ub;
+		ub.eta = (T)eta;
+		ub.step = (T)(eta/Params::batch_size);
+		ub.inv_batch = (T)(1.0/Params::batch_size);
+		ub.l2 = ub.wd = 0;
+		ub.decay = 1;
+		detail::bias_corrections<Optimizer>(ub, ++updates, (const Optimizer *)nullptr);
+
+		// Weight decay (L2 regularization) only for the weights
+		detail::UpdateStep<T> uw = ub;
+		uw.l2 = (T)(Params::regularization_param/data_size);
+		uw.wd = (T)(eta*(Params::regularization_param/data_size));
+		uw.decay = (T)(1-eta*(Params::regularization_param/data_size));
+
+		for(size_t i = 1; i < n.b.size(); ++i){
+			detail::apply_update<Optimizer>(n.b[i].memptr(), nabla_b[i].memptr(), state(opt_b[0], i), state(opt_b[1], i),
+				n.b[i].n_elem, ub, Optimizer{});
+		}
+
+		for(size_t i = 0; i < n.w.size(); ++i){
+			detail::apply_update<Optimizer>(n.w[i].memptr(), nabla_w[i].memptr(), state(opt_w[0], i), state(opt_w[1], i),
+				n.w[i].n_elem, uw, Optimizer{});
+		}
+	}
 
 };
 
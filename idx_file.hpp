@@ -0,0 +1,245 @@
+#ifndef _IDX_FILE_HPP
+#define _IDX_FILE_HPP
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "training_data.hpp"
+
+
+/**
+* IDX files (the format of the MNIST data set, see http://yann.lecun.com/exdb/mnist/): a magic number
+* 0x00 0x00 <type> <number of dimensions>, the dimensions as big-endian 32-bit integers and the data
+* in row-major order. Only unsigned bytes (type 0x08) are supported, which is what MNIST uses.
+*
+* The files are mmapped, the bytes are used in place and converted to floating point only when needed,
+* a minibatch or a chunk at a time.
+*/
+
+
+namespace nn{
+
+class IdxFile{
+public:
+	IdxFile() = default;
+
+	// ndim - the expected number of dimensions
+	IdxFile(const std::string & file, size_t ndim){
+		int fd = ::open(file.c_str(), O_RDONLY);
+		if(fd < 0) throw std::runtime_error{"Cannot open the IDX file " + file + "."};
+
+		struct stat st;
+		if(::fstat(fd, &st) != 0 || st.st_size < 4){
+			::close(fd);
+			throw std::runtime_error{"Bad IDX file " + file + "."};
+		}
+		len = (size_t)st.st_size;
+
+		void * p = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(p == MAP_FAILED) throw std::runtime_error{"Cannot map the IDX file " + file + "."};
+		base = (const uint8_t*)p;
+
+		try{
+			validate(file, ndim);
+		}
+		catch(...){
+			unmap();
+			throw;
+		}
+	}
+
+	~IdxFile(){
+		unmap();
+	}
+
+	IdxFile(IdxFile && o) noexcept {
+		*this = std::move(o);
+	}
+
+	IdxFile & operator=(IdxFile && o) noexcept {
+		if(this != &o){
+			unmap();
+			base = o.base; len = o.len; dims = std::move(o.dims);
+			o.base = nullptr; o.len = 0;
+		}
+		return *this;
+	}
+
+	IdxFile(const IdxFile &) = delete;
+	IdxFile & operator=(const IdxFile &) = delete;
+
+	size_t dim(size_t i) const {
+		return dims.at(i);
+	}
+
+	// The number of items (the first dimension) and the bytes of one item (the product of the others)
+	size_t size() const {
+		return dims.empty() ? 0 : dims[0];
+	}
+
+	size_t item_size() const {
+		size_t ret = 1;
+		for(size_t i = 1; i < dims.size(); ++i) ret *= dims[i];
+		return ret;
+	}
+
+	const uint8_t * item(size_t i) const {
+		return data() + i*item_size();
+	}
+
+	const uint8_t * data() const {
+		return base + 4 + 4*dims.size();
+	}
+
+private:
+	const uint8_t * base = nullptr;
+	size_t len = 0;
+	std::vector<size_t> dims;
+
+	void unmap(){
+		if(base) ::munmap((void*)base, len);
+		base = nullptr;
+	}
+
+	void validate(const std::string & file, size_t ndim){
+		if(base[0] != 0 || base[1] != 0 || base[2] != 0x08 || base[3] != ndim){
+			throw std::runtime_error{"Wrong magic number of the IDX file " + file + "."};
+		}
+		if(len < 4 + 4*ndim) throw std::runtime_error{"Truncated IDX file " + file + "."};
+
+		dims.resize(ndim);
+		for(size_t i = 0; i < ndim; ++i){
+			const uint8_t * d = base + 4 + 4*i;
+			dims[i] = ((size_t)d[0] << 24) | ((size_t)d[1] << 16) | ((size_t)d[2] << 8) | (size_t)d[3];
+		}
+
+		if(len < 4 + 4*ndim + size()*item_size()) throw std::runtime_error{"Truncated IDX file " + file + "."};
+	}
+};
+
+
+// n items of an IDX file from first on, as the columns of out (item_size() x n), every byte multiplied by scale
+template<class T>
+void convert_items(const IdxFile & f, size_t first, size_t n, T scale, T * out){
+	const uint8_t * in = f.item(first);
+	for(size_t i = 0; i < n*f.item_size(); ++i) out[i] = in[i]*scale;
+}
+
+// The same for labels, as one-hot columns of out (classes x n)
+template<class T>
+void convert_labels(const IdxFile & f, size_t first, size_t n, size_t classes, T * out){
+	const uint8_t * in = f.item(first);
+	std::fill(out, out + classes*n, T(0));
+	for(size_t i = 0; i < n; ++i) out[i*classes + in[i]] = T(1);
+}
+
+
+/**
+* Training data from an IDX file of images and one of their labels (classes of 0..classes-1).
+* The inputs are the bytes of the images multiplied by scale, the outputs one-hot vectors of the labels,
+* both computed when a minibatch is acquired, so the whole data set takes only the size of the files
+* (shared with the page cache) and one buffer per minibatch in use.
+*/
+template<class T>
+class IdxDataSource : public TrainingDataSource<T> {
+public:
+	IdxDataSource(const std::string & images_f, const std::string & labels_f, size_t classes, T scale = T(1)/255):
+			images(images_f, 3), labels(labels_f, 1), classes(classes), scale(scale) {
+		if(images.size() != labels.size()) throw std::runtime_error{"Different numbers of images and labels."};
+
+		const uint8_t * l = labels.data();
+		if(std::any_of(l, l + labels.size(), [classes] (uint8_t x) { return x >= classes; })){
+			throw std::runtime_error{"Label out of range."};
+		}
+	}
+
+	size_t size() const override { return images.size(); }
+	size_t input_size() const override { return images.item_size(); }
+	size_t output_size() const override { return classes; }
+
+	void start_epoch(size_t bs) override {
+		std::lock_guard<std::mutex> lock(mutex);
+		if(bs != batch_size) spare.clear();
+		batch_size = bs;
+	}
+
+	TrainingBatch<T> acquire(size_t batch_i) override {
+		std::unique_ptr<Buffer> b;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if(!spare.empty()){
+				b = std::move(spare.back());
+				spare.pop_back();
+			}
+		}
+		if(!b){
+			b.reset(new Buffer);
+			b->input.resize(batch_size*input_size());
+			b->output.resize(batch_size*classes);
+		}
+
+		b->batch = batch_i;
+		convert_items(images, batch_i*batch_size, batch_size, scale, b->input.data());
+		convert_labels(labels, batch_i*batch_size, batch_size, classes, b->output.data());
+
+		TrainingBatch<T> ret{ b->input.data(), b->output.data(), batch_size };
+
+		std::lock_guard<std::mutex> lock(mutex);
+		in_use.push_back(std::move(b));
+		return ret;
+	}
+
+	void release(size_t batch_i) override {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = std::find_if(in_use.begin(), in_use.end(), [batch_i] (auto && b) { return b->batch == batch_i; });
+		if(it == in_use.end()) return;
+
+		spare.push_back(std::move(*it));
+		in_use.erase(it);
+	}
+
+	void copy_samples(const size_t * idx, size_t n, T * input, T * output) override {
+		for(size_t i = 0; i < n; ++i){
+			convert_items(images, idx[i], 1, scale, input + i*input_size());
+			convert_labels(labels, idx[i], 1, classes, output + i*classes);
+		}
+	}
+
+	// n images from first on as columns of a matrix (e.g. a calibration sample)
+	arma::Mat<T> inputs(size_t first, size_t n) const {
+		arma::Mat<T> ret(input_size(), n);
+		convert_items(images, first, n, scale, ret.memptr());
+		return ret;
+	}
+
+private:
+	struct Buffer{
+		size_t batch;
+		std::vector<T> input, output;
+	};
+
+	IdxFile images, labels;
+	size_t classes;
+	T scale;
+
+	size_t batch_size = 0;
+
+	// One buffer per minibatch being used (at most one per training thread), reused
+	std::mutex mutex;
+	std::vector<std::unique_ptr<Buffer>> in_use, spare;
+};
+
+};
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef _INFERENCE_QUEUE_HPP
+#define _INFERENCE_QUEUE_HPP
+
+#include <armadillo>
+#include <array>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+
+/**
+* Usage: InferenceQueue<Network<...>> q(net, {max_batch_size, max_delay});
+* std::future<std::array<T, output_size>> res = q.submit(input); // from any number of threads
+* q.stats();
+*
+* Dynamic micro-batching: requests coming from concurrent callers are collected until there
+* are max_batch_size of them or until the oldest one has waited max_delay, and then they are
+* classified together by one matrix pass (Network::predict), which is much cheaper than
+* one pass per request.
+*/
+
+
+namespace nn{
+
+template<class Net>
+class InferenceQueue{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	typedef typename Net::scalar_type T;
+	typedef std::array<T, Net::input_size> Input;
+	typedef std::array<T, Net::output_size> Output;
+
+	struct Config{
+		size_t max_batch_size;
+		std::chrono::microseconds max_delay;
+	};
+
+	// Latencies are measured from submit to the completion of the future, over the last latency_window requests
+	struct Stats{
+		double p50_latency_us;
+		double p99_latency_us;
+		double mean_batch_size;
+		size_t requests;
+		size_t batches;
+	};
+
+	const static size_t latency_window = 4096;
+
+	// net is only read (through the const predict) and has to outlive the queue
+	InferenceQueue(const Net & net, Config config = Config{32, std::chrono::microseconds(500)}):
+			net(net), config(config) {
+		if(config.max_batch_size == 0) throw std::invalid_argument{"Zero batch size."};
+
+		input.set_size(Net::input_size, config.max_batch_size);
+		batch.reserve(config.max_batch_size);
+		latencies.reserve(latency_window);
+
+		worker = std::thread([this] () { worker_loop(); });
+	}
+
+	// Requests which are already queued are still processed
+	~InferenceQueue(){
+		{
+			std::lock_guard<std::mutex> lock(m);
+			quit = true;
+		}
+		cv.notify_one();
+		worker.join();
+	}
+
+	InferenceQueue(const InferenceQueue &) = delete;
+	InferenceQueue & operator=(const InferenceQueue &) = delete;
+
+	std::future<Output> submit(const Input & in){
+		Request r;
+		r.input = in;
+		r.submitted = clock::now();
+		auto ret = r.result.get_future();
+
+		{
+			std::lock_guard<std::mutex> lock(m);
+			if(quit) throw std::logic_error{"The queue is stopped."};
+			pending.push_back(std::move(r));
+		}
+		cv.notify_one();
+
+		return ret;
+	}
+
+	Stats stats() const {
+		std::vector<double> l;
+		Stats ret;
+		{
+			std::lock_guard<std::mutex> lock(stats_m);
+			l = latencies;
+			ret.requests = requests;
+			ret.batches = batches;
+		}
+
+		ret.mean_batch_size = ret.batches ? (double)ret.requests/ret.batches : 0;
+		ret.p50_latency_us = percentile(l, 0.5);
+		ret.p99_latency_us = percentile(l, 0.99);
+
+		return ret;
+	}
+
+private:
+	struct Request{
+		Input input;
+		std::promise<Output> result;
+		clock::time_point submitted;
+	};
+
+	const Net & net;
+	const Config config;
+
+	std::mutex m;
+	std::condition_variable cv;
+	std::deque<Request> pending;
+	bool quit = false;
+
+	// Used only by the worker thread
+	std::vector<Request> batch;
+	typename Net::mat_type input;
+	typename Net::Context ctx;
+
+	mutable std::mutex stats_m;
+	std::vector<double> latencies; // ring buffer of latency_window last latencies in us
+	size_t requests = 0, batches = 0;
+
+	std::thread worker;
+
+	void worker_loop(){
+		for(;;){
+			{
+				std::unique_lock<std::mutex> lock(m);
+				cv.wait(lock, [this] () { return quit || !pending.empty(); });
+				if(pending.empty()) return; // quit
+
+				// Wait for a full batch, but at most until the deadline of the oldest request
+				auto deadline = pending.front().submitted + config.max_delay;
+				cv.wait_until(lock, deadline, [this] () { return quit || pending.size() >= config.max_batch_size; });
+
+				size_t k = std::min(pending.size(), config.max_batch_size);
+				for(size_t i = 0; i < k; ++i){
+					batch.push_back(std::move(pending.front()));
+					pending.pop_front();
+				}
+			}
+
+			process_batch();
+		}
+	}
+
+	void process_batch(){
+		const size_t k = batch.size();
+
+		for(size_t i = 0; i < k; ++i){
+			std::copy(batch[i].input.begin(), batch[i].input.end(), input.colptr(i));
+		}
+
+		// A view of the first k columns, so that the buffer does not need to be reallocated
+		const typename Net::mat_type in(input.memptr(), Net::input_size, k, false, true);
+		const typename Net::mat_type * res = nullptr;
+
+		try{
+			res = &net.predict(in, ctx);
+		}
+		catch(...){
+			for(auto && r : batch) r.result.set_exception(std::current_exception());
+		}
+
+		if(res){
+			for(size_t i = 0; i < k; ++i){
+				Output out;
+				std::copy(res->colptr(i), res->colptr(i) + Net::output_size, out.begin());
+				batch[i].result.set_value(out);
+			}
+		}
+
+		auto now = clock::now();
+		{
+			std::lock_guard<std::mutex> lock(stats_m);
+			for(auto && r : batch){
+				double us = std::chrono::duration<double, std::micro>(now - r.submitted).count();
+				if(latencies.size() < latency_window) latencies.push_back(us);
+				else latencies[requests % latency_window] = us;
+				++requests;
+			}
+			++batches;
+		}
+
+		batch.clear();
+	}
+
+	static double percentile(std::vector<double> & v, double p){
+		if(v.empty()) return 0;
+
+		auto it = v.begin() + (size_t)(p*(v.size()-1));
+		std::nth_element(v.begin(), it, v.end());
+		return *it;
+	}
+};
+
+};
+
+#endif
@@ -1,6 +1,9 @@
 #include "voice_processor.hpp"
 #include "voice_recognition_net.hpp"
 #include "mnist.hpp"
+#include "voice_stream_classifier.hpp"
+#include "voice_feature_extractor.hpp"
+#include <thread>
 
 
 
@@ -8,15 +11,25 @@ int main(){
 
 
 	MNIST m("mnist/train-images.idx3-ubyte", "mnist/train-labels.idx1-ubyte",
-		"mnist/t10k-images.idx3-ubyte", "mnist/t10k-labels.idx1-ubyte");
+		"mnist/t10k-images.idx3-ubyte", "mnist/t10k-labels.idx1-ubyte", std::thread::hardware_concurrency());
+	// Faster, but not reproducible: ..., std::thread::hardware_concurrency(), nn::Parallelism::hogwild);
 
 	
 	// VoiceRecognitionNet m("voice_gender_data");
 
+	// Or from own recordings in voices/male/*.raw and voices/female/*.raw:
+	// VoiceFeatureExtractor fe(44100);
+	// VoiceFeatureExtractor::write("voice_features", fe.extract(VoiceFeatureExtractor::list_directory("voices")));
+	// VoiceRecognitionNet m("voice_features");
+
 	// VoiceProcessor vpr("voice/voice.raw", 4, 44100);
 
 	// auto res = m.identify_voice(vpr.properties);
 
 	// std::cout << "IDENTIFIED as MALE with weight " << res.first << ", as FEMALE with weight " << res.second << std::endl;
 
+	// Live, from stdin, e.g. arecord -f S16_LE -r 44100 -c 1 -t raw | ./rocnikac
+	// VoiceStreamClassifier live(m, 44100);
+	// live.run(0, [] (auto && d) { std::cout << d.time << " s: MALE " << d.weights.first << ", FEMALE " << d.weights.second << std::endl; });
+
 }	
\ No newline at end of file
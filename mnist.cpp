@@ -1,109 +1,96 @@
 #include "mnist.hpp"
 #include "neural_network.hpp"
 #include "gradient_descent.hpp"
+#include "quantized_network.hpp"
+#include "idx_file.hpp"
+#include "evaluator.hpp"
 #include <armadillo>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <cstdlib>
 
 
 
 
 
-MNIST::MNIST(const std::string & train_i, const std::string & train_l, const std::string & test_i, const std::string & test_l){
+MNIST::MNIST(const std::string & train_i, const std::string & train_l, const std::string & test_i, const std::string & test_l,
+		size_t threads, nn::Parallelism parallelism): threads(threads) {
 	
 	load_training_data(train_i, train_l);
 	load_test_data(test_i, test_l);
 
+	gd.set_threads(threads, parallelism);
+
+	// The statistics of every epoch (phase times, GFLOP/s, loss) as JSON lines, if requested
+	if(const char * log = std::getenv("NN_TRAINING_LOG")) gd.set_monitor(nn::JsonLinesSink(log));
+
 	gd.train( [this] (auto && n, size_t epoch_i) {
-		auto && res = n->feed_forward(test_data);
-		size_t ok_cnt = 0;
-
-		for(size_t i = 0; i < test_size; ++i){
-			uint8_t dig = 11;
-			double bst = -100000000;
-			for(uint8_t j = 0; j < num_of_digits; ++j){
-				if(res(j, i) > bst){
-					bst = res(j, i);
-					dig = (uint8_t) j;
-				}
-			}
-
-			if(dig == test_labels[i]){
-				++ok_cnt;
-			}
-		}
-
-		std::cout << "After epoch #"<<epoch_i<<" I classified "<< ok_cnt<<" / "<< test_size << std::endl;
+		evaluator->evaluate_async(*n, epoch_i, [] (const nn::EvaluationResult & r) {
+			std::cout << "After epoch #"<<r.epoch<<" I classified "<< r.correct<<" / "<< r.total << std::endl;
+		});
 
 		return false;
 	});
-}
 
-// See http://yann.lecun.com/exdb/mnist/
-std::vector< std::pair< std::array<double, MNIST::img_size>, uint8_t>> MNIST::read_data(const std::string & img_f,
-						const std::string & labels_f, size_t n){
-	std::ifstream img_in(img_f, std::ios::binary);
-	std::ifstream labels_in(labels_f, std::ios::binary);
+	evaluator->wait();
+	std::cout << "Confusion matrix (rows - digits, columns - classified as):" << std::endl;
+	evaluator->last_result().print_confusion(std::cout);
 
-	img_in.seekg(16, std::ios::beg);
-	labels_in.seekg(8, std::ios::beg);
+	report_quantized();
+}
+
+template<class M>
+std::unique_ptr<nn::Evaluator<M>> MNIST::make_evaluator() const {
+	std::vector<size_t> labels(test_labels.data(), test_labels.data() + test_labels.size());
 
-	uint8_t buffer[img_size];
-	uint8_t label;
+	auto inputs = [this] (size_t first, size_t n, nn::real * out) {
+		nn::convert_items(test_images, first, n, (nn::real)1/255, out);
+	};
 
-	std::vector< std::pair< std::array<double, img_size>, uint8_t>> res(n);
+	return std::unique_ptr<nn::Evaluator<M>>(new nn::Evaluator<M>(inputs, std::move(labels), {threads, test_chunk}));
+}
 
-	for(size_t i = 0; i < n; ++i){
+void MNIST::report_quantized() const {
+	typedef std::chrono::steady_clock clock;
 
-		img_in.read((char*)buffer, img_size);
-		labels_in.read((char*)&label, 1);
+	nn::QuantizedNetwork<Net> q(gd.n, calibration_data);
+	auto q_evaluator = make_evaluator<nn::QuantizedNetwork<Net>>();
 
-		res[i].second = label;
-		for(size_t j = 0; j < img_size; ++j){
-			res[i].first[j] = ((double)buffer[j])/255.0; 
-		}
+	auto start = clock::now();
+	size_t ok_cnt = evaluator->evaluate(gd.n).correct;
+	double t = std::chrono::duration<double, std::milli>(clock::now() - start).count();
 
-	}
+	start = clock::now();
+	size_t q_ok_cnt = q_evaluator->evaluate(q).correct;
+	double q_t = std::chrono::duration<double, std::milli>(clock::now() - start).count();
 
-	img_in.close();
-	labels_in.close();
+	size_t bytes = (Net::input_size*Net::hidden_size + Net::hidden_size*Net::output_size)*sizeof(nn::real);
 
-	return std::move(res);
+	std::cout << "Quantized (int8) network classified " << q_ok_cnt << " / " << test_images.size()
+		<< " (" << ((long)q_ok_cnt - (long)ok_cnt) << " against the original), "
+		<< q_t << " ms vs " << t << " ms, weights " << q.weight_bytes() << " B vs " << bytes << " B" << std::endl;
 }
 
 void MNIST::load_training_data(const std::string & img_f, const std::string & labels_f){
+	std::unique_ptr<nn::IdxDataSource<nn::real>> src(new nn::IdxDataSource<nn::real>(img_f, labels_f, num_of_digits));
+	if(src->input_size() != img_size) throw std::runtime_error{"Wrong size of the training images."};
 
-	auto raw = read_data(img_f, labels_f, training_size);
+	calibration_data = src->inputs(0, std::min(size_t(calibration_size), src->size()));
 
-	
-	std::array<arma::mat, 2> data;
-	data[0].set_size(img_size, training_size);
-	data[1].set_size(num_of_digits, training_size);
-
-	for(size_t i = 0; i < training_size; ++i){
-		arma::vec imgs(&raw[i].first[0], img_size);
-		arma::vec labels(num_of_digits, arma::fill::zeros);
-		labels[(size_t)raw[i].second]=1.0;
-
-		data[0].col(i) = imgs;
-		data[1].col(i) = labels;
-	}
-
-	gd.set_training_data(std::move(data));
+	gd.set_data_source(std::unique_ptr<nn::TrainingDataSource<nn::real>>(
+				new nn::ShuffledDataSource<nn::real>(std::move(src), threads + 1)));
 }
 
 void MNIST::load_test_data(const std::string & img_f, const std::string & labels_f){
+	test_images = nn::IdxFile(img_f, 3);
+	test_labels = nn::IdxFile(labels_f, 1);
 
-	auto raw = read_data(img_f, labels_f, test_size);
-
-	test_data.set_size(img_size, test_size);
-	test_labels.resize(test_size);
-
-	for(size_t i = 0; i < test_size; ++i){
-		arma::vec imgs(&raw[i].first[0], img_size);
+	if(test_images.item_size() != img_size) throw std::runtime_error{"Wrong size of the test images."};
+	if(test_images.size() != test_labels.size()) throw std::runtime_error{"Different numbers of test images and labels."};
 
-		test_data.col(i) = imgs;
-		test_labels[i] = raw[i].second;
-	}
+	evaluator = make_evaluator<Net>();
 }
@@ -3,10 +3,14 @@
 
 #include "neural_network.hpp"
 #include "gradient_descent.hpp"
+#include "quantized_network.hpp"
+#include "idx_file.hpp"
+#include "evaluator.hpp"
 #include <armadillo>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <memory>
 
 
 //	MNIST m("mnist/train-images.idx3-ubyte", "mnist/train-labels.idx1-ubyte",
@@ -31,32 +35,48 @@ private:
 		constexpr static double regularization_param = 0.1; // lambda
 	};
 
-	nn::GradientDescent<nn::Network<img_size, 120, num_of_digits>, GradientDescentParams> gd;
+	typedef nn::Network<img_size, 120, num_of_digits> Net;
+
+	nn::GradientDescent<Net, GradientDescentParams> gd;
 
 
 public:
 
 
-	MNIST(const std::string & train_i, const std::string & train_l, const std::string & test_i, const std::string & test_l);
+	// threads > 1 splits every minibatch between the threads (deterministic), or with Parallelism::hogwild
+	// the threads train on their own minibatches and update the weights without locking (faster, not reproducible)
+	MNIST(const std::string & train_i, const std::string & train_l, const std::string & test_i, const std::string & test_l,
+		size_t threads = 1, nn::Parallelism parallelism = nn::Parallelism::synchronous);
 
 
 private:
 
-	static const size_t training_size = 60000;
-	static const size_t test_size = 10000;
+	static const size_t calibration_size = 1000; // training images used to calibrate the quantized network
+	static const size_t test_chunk = 1000; // test images evaluated (and converted to floating point) at once
+
+	size_t threads;
+
+	// The mapped IDX files, see http://yann.lecun.com/exdb/mnist/
+	nn::IdxFile test_images, test_labels;
 
-	arma::mat test_data;
-	std::vector<uint8_t> test_labels;
+	// Evaluates the network after every epoch while the next one is trained
+	std::unique_ptr<nn::Evaluator<Net>> evaluator;
 
+	arma::Mat<nn::real> calibration_data;
 
-	// See http://yann.lecun.com/exdb/mnist/
-	std::vector< std::pair< std::array<double, img_size>, uint8_t>> read_data(const std::string & img_f,
-							const std::string & labels_f, size_t n);
 
+	// Shuffled every epoch, gathered on a background thread for the training threads
 	void load_training_data(const std::string & img_f, const std::string & labels_f);
 
 	void load_test_data(const std::string & img_f, const std::string & labels_f);
 
+	// An evaluator of the test set for Net or its quantized version, the images are converted a chunk at a time
+	template<class M>
+	std::unique_ptr<nn::Evaluator<M>> make_evaluator() const;
+
+	// Compares the trained network with its int8 quantization on the test set
+	void report_quantized() const;
+
 };
 
 
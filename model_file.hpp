@@ -0,0 +1,304 @@
+#ifndef _MODEL_FILE_HPP
+#define _MODEL_FILE_HPP
+
+#include <array>
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+/**
+* Binary model file format (all numbers in the byte order of the machine which wrote the file):
+*
+* Header (see ModelFileHeader): magic "NNMODEL\0", version, endianness marker, number of layers
+*	and their sizes, number of blocks and a checksum of everything after the header.
+* Block table: blocks_n times ModelFileBlock (dtype, rows, columns and offset of each block).
+* Blocks: raw column-major matrices, every one aligned to block_alignment bytes from the start
+*	of the file (so an mmapped file can be used directly as armadillo memory).
+*
+* Network stores w[0], b[1], w[1], b[2], ... in this order; other users (quantized weights,
+* optimizer state) append their own blocks after those.
+*/
+
+
+namespace nn{
+
+enum class DType : uint32_t { f64 = 1, f32 = 2, i8 = 3, i32 = 4 };
+
+inline size_t dtype_size(DType t){
+	switch(t){
+		case DType::f64: return 8;
+		case DType::f32: return 4;
+		case DType::i8: return 1;
+		case DType::i32: return 4;
+	}
+	throw std::runtime_error{"Unknown dtype in model file."};
+}
+
+template<class T> struct dtype_of;
+template<> struct dtype_of<double> { static const DType value = DType::f64; };
+template<> struct dtype_of<float> { static const DType value = DType::f32; };
+template<> struct dtype_of<int8_t> { static const DType value = DType::i8; };
+template<> struct dtype_of<int32_t> { static const DType value = DType::i32; };
+
+
+const size_t model_file_max_layers = 8;
+const size_t block_alignment = 64;
+const uint32_t model_file_version = 1;
+const uint32_t endianness_marker = 0x01020304;
+
+struct ModelFileHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t endianness;
+	uint32_t layers_n;
+	uint32_t blocks_n;
+	uint64_t sizes[model_file_max_layers];
+	uint64_t checksum;
+};
+
+struct ModelFileBlock{
+	uint32_t dtype;
+	uint32_t reserved;
+	uint64_t rows, cols;
+	uint64_t offset; // from the start of the file
+};
+
+static_assert(sizeof(ModelFileHeader) == 96, "Unexpected padding in ModelFileHeader.");
+static_assert(sizeof(ModelFileBlock) == 32, "Unexpected padding in ModelFileBlock.");
+
+namespace detail{
+
+	const char model_file_magic[8] = { 'N', 'N', 'M', 'O', 'D', 'E', 'L', '\0' };
+
+	inline size_t align_up(size_t x){
+		return (x + block_alignment - 1) / block_alignment * block_alignment;
+	}
+
+	// FNV-1a over 64-bit words (len is a multiple of 8, which holds for everything after the header)
+	inline uint64_t checksum(const char * data, size_t len){
+		uint64_t h = 14695981039346656037ULL;
+		for(size_t i = 0; i + 8 <= len; i += 8){
+			uint64_t word;
+			std::memcpy(&word, data + i, 8);
+			h = (h ^ word) * 1099511628211ULL;
+		}
+		return h;
+	}
+
+	// The mode of the file replaced by a new one, or what open() would give a new file (0666 without the umask)
+	inline mode_t new_file_mode(const std::string & replaced){
+		struct stat st;
+		if(::stat(replaced.c_str(), &st) == 0) return st.st_mode & 07777;
+
+		// umask() can only be read by setting it, so only once
+		static const mode_t mask = [] () { mode_t m = ::umask(0); ::umask(m); return m; }();
+		return 0666 & ~mask;
+	}
+
+};
+
+// True if the file starts with the magic of the binary format (otherwise it is presumably the ASCII one)
+inline bool is_binary_model_file(const std::string & file){
+	std::ifstream in(file, std::ios::binary);
+	char magic[8];
+	if(!in.read(magic, 8)) return false;
+	return std::memcmp(magic, detail::model_file_magic, 8) == 0;
+}
+
+
+/**
+* Usage: ModelFileWriter wr(sizes);
+* wr.add_block(m.memptr(), m.n_rows, m.n_cols); ...
+* wr.write(file);
+*/
+class ModelFileWriter{
+public:
+	explicit ModelFileWriter(const std::vector<size_t> & sizes): sizes(sizes) {
+		if(sizes.size() > model_file_max_layers) throw std::invalid_argument{"Too many layers for the model file."};
+	}
+
+	// The data are only referenced, they have to live until write()
+	template<class T>
+	void add_block(const T * data, size_t rows, size_t cols){
+		blocks.push_back(Block{dtype_of<T>::value, rows, cols, data});
+	}
+
+	void write(const std::string & file) const {
+		size_t table_end = sizeof(ModelFileHeader) + blocks.size()*sizeof(ModelFileBlock);
+
+		std::vector<ModelFileBlock> table(blocks.size());
+		size_t pos = detail::align_up(table_end);
+		for(size_t i = 0; i < blocks.size(); ++i){
+			table[i] = ModelFileBlock{ (uint32_t)blocks[i].dtype, 0, blocks[i].rows, blocks[i].cols, pos };
+			pos = detail::align_up(pos + bytes(blocks[i]));
+		}
+
+		// Everything after the header, so that the checksum can be computed
+		std::vector<char> body(pos - sizeof(ModelFileHeader), 0);
+		std::memcpy(&body[0], table.data(), table.size()*sizeof(ModelFileBlock));
+		for(size_t i = 0; i < blocks.size(); ++i){
+			if(bytes(blocks[i])) std::memcpy(&body[table[i].offset - sizeof(ModelFileHeader)], blocks[i].data, bytes(blocks[i]));
+		}
+
+		ModelFileHeader h;
+		std::memset(&h, 0, sizeof(h));
+		std::memcpy(h.magic, detail::model_file_magic, 8);
+		h.version = model_file_version;
+		h.endianness = endianness_marker;
+		h.layers_n = (uint32_t)sizes.size();
+		h.blocks_n = (uint32_t)blocks.size();
+		for(size_t i = 0; i < sizes.size(); ++i) h.sizes[i] = sizes[i];
+		h.checksum = detail::checksum(body.data(), body.size());
+
+		// A new file renamed over the old one, because processes may have the old one mapped
+		// (rewriting it in place would change their weights or even crash them). The temporary file
+		// has a unique name in the same directory, so that concurrent writers do not write into the same one.
+		std::string tmp = file + ".XXXXXX";
+		int fd = ::mkstemp(&tmp[0]);
+		if(fd < 0) throw std::runtime_error{"Cannot write the model file."};
+
+		bool ok = ::fchmod(fd, detail::new_file_mode(file)) == 0 // mkstemp creates it readable only by the owner
+			&& write_all(fd, (const char*)&h, sizeof(h)) && write_all(fd, body.data(), body.size());
+		ok = ::close(fd) == 0 && ok;
+
+		if(!ok || std::rename(tmp.c_str(), file.c_str()) != 0){
+			std::remove(tmp.c_str());
+			throw std::runtime_error{"Cannot write the model file."};
+		}
+	}
+
+private:
+	struct Block{
+		DType dtype;
+		size_t rows, cols;
+		const void * data;
+	};
+
+	std::vector<size_t> sizes;
+	std::vector<Block> blocks;
+
+	static size_t bytes(const Block & b){
+		return b.rows*b.cols*dtype_size(b.dtype);
+	}
+
+	static bool write_all(int fd, const char * data, size_t len){
+		while(len > 0){
+			ssize_t r = ::write(fd, data, len);
+			if(r <= 0) return false;
+			data += r;
+			len -= (size_t)r;
+		}
+		return true;
+	}
+};
+
+
+/**
+* A validated, mmapped binary model file. The mapping is private and writable, i.e. copy-on-write:
+* the blocks can be used (and modified, e.g. by further training) in place without touching the file.
+* Only the pages which are really read are loaded from the disk: opening checks the header and the block
+* table, the checksum (which reads the whole file) only verify().
+*/
+class MappedModelFile{
+public:
+	explicit MappedModelFile(const std::string & file){
+		int fd = ::open(file.c_str(), O_RDONLY);
+		if(fd < 0) throw std::runtime_error{"Cannot open the model file."};
+
+		struct stat st;
+		if(::fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ModelFileHeader)){
+			::close(fd);
+			throw std::runtime_error{"Bad model file."};
+		}
+		len = (size_t)st.st_size;
+
+		void * p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if(p == MAP_FAILED) throw std::runtime_error{"Cannot map the model file."};
+		base = (char*)p;
+
+		try{
+			validate();
+		}
+		catch(...){
+			::munmap(base, len);
+			throw;
+		}
+	}
+
+	~MappedModelFile(){
+		::munmap(base, len);
+	}
+
+	MappedModelFile(const MappedModelFile &) = delete;
+	MappedModelFile & operator=(const MappedModelFile &) = delete;
+
+	const ModelFileHeader & header() const {
+		return *(const ModelFileHeader*)base;
+	}
+
+	size_t blocks_n() const {
+		return header().blocks_n;
+	}
+
+	const ModelFileBlock & block(size_t i) const {
+		if(i >= blocks_n()) throw std::runtime_error{"Missing block in the model file."};
+		return ((const ModelFileBlock*)(base + sizeof(ModelFileHeader)))[i];
+	}
+
+	// Checks the type and the shape of the i-th block and returns a pointer to its data
+	template<class T>
+	T * data(size_t i, size_t rows, size_t cols) const {
+		auto && b = block(i);
+		if(b.dtype != (uint32_t)dtype_of<T>::value) throw std::runtime_error{"Wrong dtype in the model file."};
+		if(b.rows != rows || b.cols != cols) throw std::runtime_error{"Wrong topology."};
+		return (T*)(base + b.offset);
+	}
+
+	// Compares the checksum with the contents, throws if they differ (a corrupted file)
+	void verify() const {
+		if(detail::checksum(base + sizeof(ModelFileHeader), len - sizeof(ModelFileHeader)) != header().checksum){
+			throw std::runtime_error{"Model file checksum mismatch."};
+		}
+	}
+
+private:
+	char * base;
+	size_t len;
+
+	void validate() const {
+		auto && h = header();
+
+		if(std::memcmp(h.magic, detail::model_file_magic, 8) != 0) throw std::runtime_error{"Not a binary model file."};
+		if(h.endianness != endianness_marker) throw std::runtime_error{"The model file has a different endianness."};
+		if(h.version != model_file_version) throw std::runtime_error{"Unsupported model file version."};
+		if(h.layers_n > model_file_max_layers) throw std::runtime_error{"Bad model file."};
+
+		size_t table_end = sizeof(ModelFileHeader) + (size_t)h.blocks_n*sizeof(ModelFileBlock);
+		if(table_end > len) throw std::runtime_error{"Truncated model file."};
+
+		for(size_t i = 0; i < h.blocks_n; ++i){
+			auto && b = block(i);
+			size_t bytes = b.rows*b.cols*dtype_size((DType)b.dtype);
+			if(b.offset % block_alignment != 0 || b.offset < table_end || b.offset > len || bytes > len - b.offset){
+				throw std::runtime_error{"Truncated model file."};
+			}
+		}
+	}
+};
+
+};
+
+#endif
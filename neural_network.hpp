@@ -11,28 +11,59 @@
 #include <algorithm>
 #include <utility>
 #include <stdexcept>
+#include <memory>
+#include <vector>
+
+#include "model_file.hpp"
+#include "activation.hpp"
+#include "fixed_kernels.hpp"
+#include "training_monitor.hpp"
 
 // [1] http://neuralnetworksanddeeplearning.com
 
 
 /**
-* Usage: Network<input_layer_size, hidden_layer_size, output_layer_size> n([file_with_weights]);
-* n.save(file);
-* vector<vector<double> > n.feed_forward(input); // input is vector<vector<double> >, the inner vector
+* Usage: Network<input_layer_size, hidden_layer_size, output_layer_size[, scalar type]> n([file_with_weights]);
+* n.save(file[, ModelFormat::binary]); // the format is detected by load
+* vector<vector<T> > n.feed_forward(input); // input is vector<vector<T> >, the inner vector
 * 	corresponds to the input layer.
+* n.predict(m[, ctx]); // m is arma::Mat<T> with one input per column, can be called from more threads at once
+* n.set_activation_precision(ActivationPrecision::exact); // the vectorized approximation of sigmoid is the default
+* std::array<T, os> n.predict(std::array<T, is>); // a single input, allocation-free for small networks
+* n.predict(MatrixSpan<const T>{ptr, is, n, stride}, MatrixSpan<T>{out, os, n, out_stride}[, ctx]); // caller's buffers, no copies
 */
 
 
 namespace nn{
 
+// The default scalar type of the networks (and of the applications), compile with -DNN_FLOAT for single precision
+#ifdef NN_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
+
+// ascii - the original text format (arma_ascii matrices), binary - see model_file.hpp
+enum class ModelFormat { ascii, binary };
+
+// A column-major matrix in memory owned by the caller, column j starts at data + j*stride (stride >= rows)
+template<class T>
+struct MatrixSpan{
+	T * data;
+	size_t rows, cols, stride;
+};
+
 /**
 * Could be made variadic and support multiple hidden layers, but
 * the learning algorithm is efficient only for one-hidden-layer networks
 * anyway, so I chose to keep it simple.
 */
-template<size_t is, size_t hs, size_t os>
+template<size_t is, size_t hs, size_t os, class T = real>
 class Network{
-	//Perhaps everything should be public in order to allow third-party learning algorithms?
+public:
+	typedef T scalar_type;
+	typedef arma::Mat<T> mat_type;
+	typedef arma::Col<T> vec_type;
 
 	const static size_t layers_n = 3;
 
@@ -40,37 +71,59 @@ class Network{
 		hidden_size = hs,
 		output_size = os;
 
+	// Small networks use the kernels with compile-time sizes (fixed_kernels.hpp) instead of BLAS
+	const static bool fixed_kernels = is*hs + hs*os <= NN_FIXED_KERNEL_THRESHOLD;
+
+private:
+	//Perhaps everything should be public in order to allow third-party learning algorithms?
+
 	std::array<size_t, 3> sizes;
 
 	template<class N, class Param> friend class GradientDescent;
+	template<class N> friend class QuantizedNetwork;
 
 
 	/**
 	* Weights, w[i] is the matrix of weights between i-th and (i+1)-th layer,
 	* CAUTION!! w[i][j][k] = weight between the k-th neuron in i-th layer and j-th neuron in (i+1)-th layer
 	*/
-	std::vector<arma::mat> w;
+	std::vector<mat_type> w;
 
 	/**
 	* Biases of the i-th layer
 	* b[0] is undefined
 	*/
-	std::vector<arma::vec> b;
+	std::vector<vec_type> b;
 
 
 	/**
 	* Activations of the i-th layer (a[0] corresponds to the input, a[a.size() -1] to the output)
-	* arma::mat, because it enables us to process multiple inputs at once.
+	* a matrix, because it enables us to process multiple inputs at once.
 	*/
-	std::vector<arma::mat> a;
+	std::vector<mat_type> a;
 
 	/**
 	* Weighed input to i-th layer (see [1]), w[0] is undefined.
 	*/
-	std::vector<arma::mat> z;
+	std::vector<mat_type> z;
+
+	// The binary model file whose memory w and b use (if they were loaded from one)
+	std::shared_ptr<MappedModelFile> mapping;
+
+	ActivationPrecision act_precision = ActivationPrecision::fast;
 
 
 public:
+	/**
+	* Activations of all layers for one predict call. It is owned by the caller,
+	* hence more threads can share one network, each with its own context. The buffers are reused
+	* by subsequent calls with the same number of inputs.
+	*/
+	struct Context{
+		std::vector<mat_type> a; // a[0] unused, the input is read in place
+		mat_type scratch; // blocks of strided inputs/outputs
+	};
+
 	Network() {
 		init();
 
@@ -84,17 +137,29 @@ public:
 	}
 
 
-	void save(const std::string & file){
-		save_to_file(file);
+	void save(const std::string & file, ModelFormat format = ModelFormat::ascii){
+		if(format == ModelFormat::binary) save_to_binary_file(file);
+		else save_to_file(file);
 	}
 
+	// Accepts both formats, a binary file is mmapped and its weights are used in place
 	void load(const std::string & file){
 		fill_from_file(file);
 	}
 
-	std::vector< std::vector<double> > feed_forward(const std::vector< std::vector<double> > & input){
+	// The sigmoid used by feed_forward, predict and the training, see activation.hpp (fast by default)
+	void set_activation_precision(ActivationPrecision p){
+		act_precision = p;
+	}
+
+	ActivationPrecision activation_precision() const {
+		return act_precision;
+	}
+
+	// Thin wrapper over the span predict (the inputs are gathered into a reused thread-local buffer)
+	std::vector< std::vector<T> > feed_forward(const std::vector< std::vector<T> > & input) const {
 		size_t testcases = input.size();
-		if(testcases == 0) return std::vector< std::vector<double> > {};
+		if(testcases == 0) return std::vector< std::vector<T> > {};
 
 		size_t size = input[0].size();
 
@@ -104,51 +169,212 @@ public:
 
 		if(size != input_size) throw std::invalid_argument{"Wrong input size."};
 
-		std::vector<double> tmp(testcases*size);
+		static thread_local std::vector<T> in, out;
+		in.resize(testcases*input_size);
+		out.resize(testcases*output_size);
 
-		auto it = tmp.begin();
-
-		for(auto &&x : input){
-			it = std::copy(x.begin(), x.end(), it);
+		for(size_t i = 0; i < testcases; ++i){
+			std::copy(input[i].begin(), input[i].end(), in.begin() + i*input_size);
 		}
 
-		// Copy data from memory
-		arma::mat m(&tmp[0], size, testcases, false);
-
-		auto && res = feed_forward(m);
+		predict(MatrixSpan<const T>{ in.data(), input_size, testcases, input_size },
+			MatrixSpan<T>{ out.data(), output_size, testcases, output_size });
 
-		std::vector< std::vector<double>> ret(res.n_cols);
+		std::vector< std::vector<T>> ret(testcases);
 
-		for (size_t i = 0; i < res.n_cols; ++i) {
-			ret[i] = arma::conv_to< std::vector<double> >::from(res.col(i));
+		for (size_t i = 0; i < testcases; ++i) {
+			ret[i].assign(out.begin() + i*output_size, out.begin() + (i+1)*output_size);
 		};
 
-		return std::move(ret);
+		return ret;
 	}
 
 
 
-	arma::mat & feed_forward(arma::mat input){
+	// Stores the activations of all layers in the network itself, hence it is not reentrant
+	mat_type & feed_forward(mat_type input){
 		if(input.n_rows != input_size) throw std::invalid_argument{"Wrong input size."};
 
-		// When processing more queries at the same time, we need to "copy" the bias vector
-		arma::rowvec biases_to_matrix(input.n_cols, arma::fill::ones);
+		a[0] = std::move(input);
+		forward(a[0], a, &z);
 
-		a[0] = input;
+		return a[layers_n-1];
+	}
 
-		for(size_t i = 0; i < layers_n-1; ++i){
-			a[i+1] = z[i+1] = w[i]*a[i] + b[i+1]*biases_to_matrix;
-			a[i+1].transform([] (double x) { return sigmoid(x); });
+	/**
+	* Reentrant zero-copy inference: reads input.cols inputs from the caller's memory and writes the outputs
+	* into output (which needs output_size rows and the same number of columns), ctx holds only the hidden layer.
+	* Both spans may have a stride larger than their rows, e.g. rows of a row-major array of structures.
+	*/
+	void predict(MatrixSpan<const T> input, MatrixSpan<T> output, Context & ctx) const {
+		if(input.rows != input_size || input.stride < input.rows) throw std::invalid_argument{"Wrong input size."};
+		if(output.rows != output_size || output.stride < output.rows || output.cols != input.cols){
+			throw std::invalid_argument{"Wrong output size."};
 		}
 
-		return a[layers_n-1];
+		ctx.a.resize(layers_n);
+		ctx.a[1].set_size(hs, input.cols);
+
+		layer<hs, is>(0, input, span(ctx.a[1]), nullptr, ctx.scratch);
+		layer<os, hs>(1, span(static_cast<const mat_type &>(ctx.a[1])), output, nullptr, ctx.scratch);
+	}
+
+	// The same with a thread-local context
+	void predict(MatrixSpan<const T> input, MatrixSpan<T> output) const {
+		static thread_local Context ctx;
+		predict(input, output, ctx);
+	}
+
+	/**
+	* Reentrant inference, reads only the weights and writes only into ctx.
+	* Returns the output layer (a reference into ctx), one column per input column.
+	*/
+	const mat_type & predict(const mat_type & input, Context & ctx) const {
+		ctx.a.resize(layers_n);
+		ctx.a[layers_n-1].set_size(output_size, input.n_cols);
+
+		predict(span(input), span(ctx.a[layers_n-1]), ctx);
+
+		return ctx.a[layers_n-1];
+	}
+
+	// The same with a thread-local context, the result is valid until the next predict call on the same thread
+	const mat_type & predict(const mat_type & input) const {
+		static thread_local Context ctx;
+		return predict(input, ctx);
+	}
+
+	// A single input; with the fixed kernels everything is on the stack
+	std::array<T, os> predict(const std::array<T, is> & input) const {
+		return predict_one(input, std::integral_constant<bool, fixed_kernels>{});
 	}
 
 
 private:
 
-	static double sigmoid(double x){
-		return 1.0 / (1.0 + std::exp(-x));
+	// Bytes of the output of one layer computed at once by the BLAS path, so that it stays in the cache
+	// between the matrix product and the activation
+	const static size_t forward_block_bytes = 64*1024;
+
+	static MatrixSpan<const T> span(const mat_type & m){
+		return MatrixSpan<const T>{ m.memptr(), m.n_rows, m.n_cols, m.n_rows };
+	}
+
+	static MatrixSpan<T> span(mat_type & m){
+		return MatrixSpan<T>{ m.memptr(), m.n_rows, m.n_cols, m.n_rows };
+	}
+
+	// Computes activations[1..] from input (index 0 is not touched), and also weighed[1..] if weighed is not null
+	// (both need layers_n elements). If layer_time is not null, the seconds spent in layer i are added to layer_time[i].
+	void forward(const mat_type & input, std::vector<mat_type> & activations, std::vector<mat_type> * weighed,
+			double * layer_time = nullptr) const {
+		mat_type scratch; // not used, all the matrices are contiguous
+
+		T * z[layers_n] = {};
+		for(size_t i = 1; i < layers_n; ++i){
+			activations[i].set_size(sizes[i], input.n_cols);
+			if(weighed){
+				(*weighed)[i].set_size(sizes[i], input.n_cols);
+				z[i] = (*weighed)[i].memptr();
+			}
+		}
+
+		detail::Stopwatch sw(layer_time != nullptr);
+		layer<hs, is>(0, span(input), span(activations[1]), z[1], scratch);
+		if(layer_time) sw.lap(layer_time[0]);
+		layer<os, hs>(1, span(static_cast<const mat_type &>(activations[1])), span(activations[2]), z[2], scratch);
+		if(layer_time) sw.lap(layer_time[1]);
+	}
+
+	/**
+	* Layer i with R x C weights: out = sigmoid(w[i]*in + b[i+1]), also storing the weighed input into z
+	* (R x in.cols, contiguous) if it is not null. scratch is used only if a span is not contiguous.
+	*/
+	template<size_t R, size_t C>
+	void layer(size_t i, MatrixSpan<const T> in, MatrixSpan<T> out, T * z, mat_type & scratch) const {
+		layer<R, C>(i, in, out, z, scratch, std::integral_constant<bool, fixed_kernels>{});
+	}
+
+	/**
+	* The BLAS path: one pass over blocks of columns, the product of the weights with the block is written
+	* right into the output (or z), and the bias and the sigmoid are applied while it is in the cache.
+	* Strided blocks are gathered into (and scattered from) the block-sized scratch.
+	*/
+	template<size_t R, size_t C>
+	void layer(size_t i, MatrixSpan<const T> in, MatrixSpan<T> out, T * z, mat_type & scratch, std::false_type) const {
+		const size_t cols = in.cols;
+		const size_t block = std::max<size_t>(1, forward_block_bytes/(R*sizeof(T)));
+		const bool gather = in.stride != C, scatter = !z && out.stride != R;
+		const T * bias = b[i+1].memptr();
+
+		if(gather || scatter) scratch.set_size(C + R, block);
+		T * in_buf = scratch.memptr(), * out_buf = scratch.memptr() + C*block;
+
+		for(size_t c0 = 0; c0 < cols; c0 += block){
+			const size_t bc = std::min(block, cols - c0);
+
+			const T * in_ptr = in.data + c0*in.stride;
+			if(gather){
+				for(size_t c = 0; c < bc; ++c) std::copy(in_ptr + c*in.stride, in_ptr + c*in.stride + C, in_buf + c*C);
+				in_ptr = in_buf;
+			}
+
+			// Without z, the weighed input is computed in the output itself
+			T * z_ptr = z ? z + c0*R : (scatter ? out_buf : out.data + c0*out.stride);
+
+			const mat_type in_block(const_cast<T*>(in_ptr), C, bc, false, true);
+			mat_type z_block(z_ptr, R, bc, false, true);
+
+			z_block = w[i]*in_block;
+
+			// When processing more queries at the same time, the bias is added to every column
+			for(size_t c = 0; c < bc; ++c){
+				for(size_t r = 0; r < R; ++r) z_ptr[c*R + r] += bias[r];
+			}
+
+			activate(z_ptr, R, out.data + c0*out.stride, out.stride, R, bc);
+		}
+	}
+
+	// The same with the fixed kernels, which handle the strides themselves
+	template<size_t R, size_t C>
+	void layer(size_t i, MatrixSpan<const T> in, MatrixSpan<T> out, T * z, mat_type &, std::true_type) const {
+		if(z){
+			fixed::affine<R, C>(w[i].memptr(), b[i+1].memptr(), in.data, in.stride, z, R, in.cols);
+			activate(z, R, out.data, out.stride, R, in.cols);
+		}
+		else{
+			fixed::affine<R, C>(w[i].memptr(), b[i+1].memptr(), in.data, in.stride, out.data, out.stride, in.cols);
+			activate(out.data, out.stride, out.data, out.stride, R, in.cols);
+		}
+	}
+
+	// out = sigmoid(z) for rows x cols matrices with the given column strides
+	void activate(const T * z, size_t z_stride, T * out, size_t out_stride, size_t rows, size_t cols) const {
+		if(z_stride == rows && out_stride == rows){
+			sigmoid(z, out, rows*cols, act_precision);
+			return;
+		}
+
+		for(size_t c = 0; c < cols; ++c) sigmoid(z + c*z_stride, out + c*out_stride, rows, act_precision);
+	}
+
+	std::array<T, os> predict_one(const std::array<T, is> & input, std::true_type) const {
+		std::array<T, hs> hidden;
+		std::array<T, os> ret;
+
+		fixed::affine<hs, is>(w[0].memptr(), b[1].memptr(), input.data(), is, hidden.data(), hs, 1);
+		sigmoid(hidden.data(), hidden.data(), hs, act_precision);
+		fixed::affine<os, hs>(w[1].memptr(), b[2].memptr(), hidden.data(), hs, ret.data(), os, 1);
+		sigmoid(ret.data(), ret.data(), os, act_precision);
+
+		return ret;
+	}
+
+	std::array<T, os> predict_one(const std::array<T, is> & input, std::false_type) const {
+		std::array<T, os> ret;
+		predict(MatrixSpan<const T>{ input.data(), is, 1, is }, MatrixSpan<T>{ ret.data(), os, 1, os });
+		return ret;
 	}
 
 	// Sets all weights as 1 and biases as 0
@@ -156,10 +382,10 @@ private:
 		std::vector<size_t> sizes = { input_size, hidden_size, output_size };
 
 		for(size_t i = 0; i < layers_n-1; ++i){
-			w.push_back(arma::mat(sizes[i+1], sizes[i], arma::fill::ones));
+			w.push_back(mat_type(sizes[i+1], sizes[i], arma::fill::ones));
 		}
 		for(size_t i = 0; i < layers_n; ++i){
-			b.push_back(arma::vec(sizes[i], arma::fill::zeros));
+			b.push_back(vec_type(sizes[i], arma::fill::zeros));
 		}
 	}
 
@@ -169,20 +395,25 @@ private:
 		std::normal_distribution<double> bias_distribution(0.0, 1.0);
 
 		for(size_t i = 0 ; i < layers_n; ++i){
-			b.push_back(arma::vec(sizes[i]));
+			b.push_back(vec_type(sizes[i]));
 			b[i].imbue( [&generator, &bias_distribution] () { return bias_distribution(generator); });
 		}
 
 		for(size_t i = 0; i < layers_n-1; ++i){
 			std::normal_distribution<double> w_distr(0.0, 1.0/std::sqrt((double)sizes[i]));
 
-			w.push_back(arma::mat(sizes[i+1], sizes[i]));
+			w.push_back(mat_type(sizes[i+1], sizes[i]));
 			w[i].imbue( [&generator, &w_distr] () { return w_distr(generator); });
 		}
 	}
 
 
 	void fill_from_file(const std::string & file){
+		if(is_binary_model_file(file)){
+			fill_from_binary_file(file);
+			return;
+		}
+
 		std::ifstream in(file);
 
 		/* Check that the file is compatible with the network topology */
@@ -195,19 +426,98 @@ private:
 			if(tmp != sizes[i]) throw std::runtime_error{"Wrong topology."};
 		}
 
-		w.resize(layers_n-1);
-		b.resize(layers_n);
+		// Fresh matrices, the old ones may live in a mapped file
+		std::vector<mat_type>(layers_n-1).swap(w);
+		std::vector<vec_type>(layers_n).swap(b);
+		mapping.reset();
 
 
+		// The text format always stores doubles (arma_ascii refuses to load a different element type)
+		arma::mat tmp_w;
+		arma::vec tmp_b;
+
 		for(size_t i = 0; i < layers_n - 1; ++i){
 
-			w[i].load(in, arma::arma_ascii);
-			b[i+1].load(in, arma::arma_ascii);
+			tmp_w.load(in, arma::arma_ascii);
+			tmp_b.load(in, arma::arma_ascii);
+
+			w[i] = arma::conv_to<mat_type>::from(tmp_w);
+			b[i+1] = arma::conv_to<vec_type>::from(tmp_b);
 		}
 
 		in.close();
 	}
 
+	void fill_from_binary_file(const std::string & file){
+		auto mapped = std::make_shared<MappedModelFile>(file);
+
+		auto && h = mapped->header();
+		if(h.layers_n != layers_n) throw std::runtime_error{"Wrong topology."};
+		for(size_t i = 0; i < layers_n; ++i){
+			if(h.sizes[i] != sizes[i]) throw std::runtime_error{"Wrong topology."};
+		}
+
+		// A file with the other floating point type is converted
+		if(mapped->block(0).dtype != (uint32_t)dtype_of<T>::value){
+			if(std::is_same<T, double>::value) fill_converted<float>(*mapped);
+			else fill_converted<double>(*mapped);
+			return;
+		}
+
+		// Collect (and check) all the blocks first, so that a bad file leaves the network untouched
+		std::vector<T*> wp(layers_n-1), bp(layers_n);
+		for(size_t i = 0; i < layers_n - 1; ++i){
+			wp[i] = mapped->data<T>(2*i, sizes[i+1], sizes[i]);
+			bp[i+1] = mapped->data<T>(2*i+1, sizes[i+1], 1);
+		}
+
+		// Matrices using the mapped memory directly (reserve, so that they are never moved)
+		std::vector<mat_type> nw;
+		std::vector<vec_type> nb;
+		nw.reserve(layers_n-1);
+		nb.reserve(layers_n);
+
+		nb.emplace_back();
+		for(size_t i = 0; i < layers_n - 1; ++i){
+			nw.emplace_back(wp[i], sizes[i+1], sizes[i], false, false);
+			nb.emplace_back(bp[i+1], sizes[i+1], false, false);
+		}
+
+		w.swap(nw);
+		b.swap(nb);
+		mapping = std::move(mapped);
+	}
+
+	// Copies the weights of a binary file with scalar type S (!= T) into own memory
+	template<class S>
+	void fill_converted(const MappedModelFile & f){
+		std::vector<mat_type> nw(layers_n-1);
+		std::vector<vec_type> nb(layers_n);
+
+		for(size_t i = 0; i < layers_n - 1; ++i){
+			const arma::Mat<S> ws(f.data<S>(2*i, sizes[i+1], sizes[i]), sizes[i+1], sizes[i], false, true);
+			const arma::Col<S> bs(f.data<S>(2*i+1, sizes[i+1], 1), sizes[i+1], false, true);
+
+			nw[i] = arma::conv_to<mat_type>::from(ws);
+			nb[i+1] = arma::conv_to<vec_type>::from(bs);
+		}
+
+		w.swap(nw);
+		b.swap(nb);
+		mapping.reset();
+	}
+
+	void save_to_binary_file(const std::string & file){
+		ModelFileWriter wr(std::vector<size_t>(sizes.begin(), sizes.end()));
+
+		for(size_t i = 0; i < layers_n - 1; ++i){
+			wr.add_block(w[i].memptr(), w[i].n_rows, w[i].n_cols);
+			wr.add_block(b[i+1].memptr(), b[i+1].n_rows, 1);
+		}
+
+		wr.write(file);
+	}
+
 	void save_to_file(const std::string & file){
 		std::ofstream out(file);
 
@@ -216,8 +526,8 @@ private:
 		out << std::endl;
 
 		for(size_t i = 0; i < layers_n - 1; ++i){
-			w[i].save(out, arma::arma_ascii);
-			b[i+1].save(out, arma::arma_ascii);
+			arma::conv_to<arma::mat>::from(w[i]).save(out, arma::arma_ascii);
+			arma::conv_to<arma::vec>::from(b[i+1]).save(out, arma::arma_ascii);
 		}
 
 		out.close();
@@ -0,0 +1,131 @@
+#ifndef _OPTIMIZERS_HPP
+#define _OPTIMIZERS_HPP
+
+#include <cstddef>
+#include <cmath>
+
+
+/**
+* Usage (in the Params policy of GradientDescent):
+* struct Optimizer : nn::Adam {}; // or nn::Momentum, nn::Nesterov, nn::Sgd (the default if there is none)
+* struct Schedule : nn::CosineDecay {}; // or nn::StepDecay, nn::ConstantRate (the default)
+* The constants can be changed in the derived struct, e.g.
+* struct Optimizer : nn::Momentum { constexpr static double momentum = 0.8; };
+*
+* Optimizers, g is the gradient averaged over the minibatch including the L2 regularization term,
+* eta the learning rate of the current epoch:
+* Sgd - w -= eta*g
+* Momentum - v = momentum*v - eta*g, w += v
+* Nesterov - the same with the lookahead, w += -momentum*v_old + (1+momentum)*v (Sutskever et al., 2013)
+* Adam - moving averages m, v of g and g^2, w -= eta*m'/(sqrt(v') + epsilon) with bias-corrected m', v' (Kingma & Ba, 2014)
+*
+* Schedules of the learning rate eta (Params::learning_rate is the initial one), epochs are numbered from 1:
+* ConstantRate - eta
+* StepDecay - eta*gamma^floor((epoch-1)/step), i.e. multiplied by gamma every step epochs
+* CosineDecay - from eta at the first epoch down to min_factor*eta at the last one along a half cosine
+*/
+
+
+namespace nn{
+
+struct Sgd{};
+struct Momentum{ constexpr static double momentum = 0.9; };
+struct Nesterov{ constexpr static double momentum = 0.9; };
+struct Adam{ constexpr static double beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8; };
+
+struct ConstantRate{};
+struct StepDecay{ constexpr static double gamma = 0.5; const static size_t step = 10; };
+struct CosineDecay{ constexpr static double min_factor = 0.01; };
+
+namespace detail{
+
+	// Called with the policy P (derived from one of the structs above) as the tag, so that its constants are used
+	template<class P>
+	double scheduled_rate(double eta, size_t, size_t, const ConstantRate &){
+		return eta;
+	}
+
+	template<class P>
+	double scheduled_rate(double eta, size_t epoch, size_t, const StepDecay &){
+		return eta*std::pow(P::gamma, (double)((epoch-1)/P::step));
+	}
+
+	template<class P>
+	double scheduled_rate(double eta, size_t epoch, size_t epochs, const CosineDecay &){
+		const double pi = 3.14159265358979323846;
+		double progress = epochs > 1 ? (double)(epoch-1)/(epochs-1) : 0;
+		double min_eta = P::min_factor*eta;
+		return min_eta + (eta - min_eta)*0.5*(1 + std::cos(pi*progress));
+	}
+
+	// The number of state arrays an optimizer keeps per parameter array
+	inline size_t state_arrays(const Sgd &) { return 0; }
+	inline size_t state_arrays(const Momentum &) { return 1; }
+	inline size_t state_arrays(const Nesterov &) { return 1; }
+	inline size_t state_arrays(const Adam &) { return 2; }
+
+	/**
+	* Everything an update needs besides the arrays, computed once per minibatch:
+	* step = eta/batch_size (the gradients are summed over the minibatch), l2 = lambda/data_size
+	* (0 for biases), decay = 1 - eta*l2, wd = eta*l2, adam_c1/2 the bias corrections 1/(1 - beta^t).
+	*/
+	template<class T>
+	struct UpdateStep{
+		T eta, step, inv_batch, l2, decay, wd;
+		T adam_c1, adam_c2;
+	};
+
+	// One fused pass over a parameter array p of n values with the summed gradient g and the state arrays of the optimizer
+	template<class P, class T>
+	inline void apply_update(T * p, const T * g, T *, T *, size_t n, const UpdateStep<T> & u, const Sgd &){
+		for(size_t i = 0; i < n; ++i) p[i] = u.decay*p[i] - u.step*g[i];
+	}
+
+	template<class P, class T>
+	inline void apply_update(T * p, const T * g, T * v, T *, size_t n, const UpdateStep<T> & u, const Momentum &){
+		const T mu = (T)P::momentum;
+		for(size_t i = 0; i < n; ++i){
+			v[i] = mu*v[i] - (u.step*g[i] + u.wd*p[i]);
+			p[i] += v[i];
+		}
+	}
+
+	template<class P, class T>
+	inline void apply_update(T * p, const T * g, T * v, T *, size_t n, const UpdateStep<T> & u, const Nesterov &){
+		const T mu = (T)P::momentum;
+		for(size_t i = 0; i < n; ++i){
+			T v_old = v[i];
+			v[i] = mu*v[i] - (u.step*g[i] + u.wd*p[i]);
+			p[i] += (1 + mu)*v[i] - mu*v_old;
+		}
+	}
+
+	template<class P, class T>
+	inline void apply_update(T * p, const T * g, T * m, T * v, size_t n, const UpdateStep<T> & u, const Adam &){
+		const T b1 = (T)P::beta1, b2 = (T)P::beta2, eps = (T)P::epsilon;
+		for(size_t i = 0; i < n; ++i){
+			T gi = g[i]*u.inv_batch + u.l2*p[i];
+			m[i] = b1*m[i] + (1 - b1)*gi;
+			v[i] = b2*v[i] + (1 - b2)*gi*gi;
+			p[i] -= u.eta*(m[i]*u.adam_c1)/(std::sqrt(v[i]*u.adam_c2) + eps);
+		}
+	}
+
+	// Bias corrections of Adam after t updates, 1 for the other optimizers
+	// (pointer tags: a pointer to the derived P converts better to const Adam * than to const void *)
+	template<class P, class T>
+	inline void bias_corrections(UpdateStep<T> & u, size_t t, const Adam *){
+		u.adam_c1 = (T)(1/(1 - std::pow(P::beta1, (double)t)));
+		u.adam_c2 = (T)(1/(1 - std::pow(P::beta2, (double)t)));
+	}
+
+	template<class P, class T>
+	inline void bias_corrections(UpdateStep<T> & u, size_t, const void *){
+		u.adam_c1 = u.adam_c2 = 1;
+	}
+
+};
+
+};
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef _QUANTIZED_NETWORK_HPP
+#define _QUANTIZED_NETWORK_HPP
+
+#include <armadillo>
+#include <array>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "neural_network.hpp"
+#include "model_file.hpp"
+#include "activation.hpp"
+
+
+/**
+* Usage: QuantizedNetwork<Network<...>> q(trained_network, calibration_inputs);
+* q.save(file); QuantizedNetwork<Network<...>> q2(file);
+* q.predict(m[, ctx]); // the same as Network::predict
+*
+* Post-training int8 quantization of a trained (read-only) network:
+* - weights are quantized per row (per neuron), w[i](r, j) ~ w_scale[i][r] * wq[i](r, j), wq in [-127, 127],
+* - the input of every layer is quantized with one scale, in_scale[i] = max|input| / 127, where the maximum
+*	is measured on a calibration sample (e.g. a part of the training data),
+* - every layer is then an integer GEMM with int32 accumulation, dequantized by w_scale * in_scale,
+*	after which the bias and the sigmoid are applied in floating point.
+* The weights take 8x less memory than doubles.
+*
+* The model file (see model_file.hpp) has four blocks per layer: the int8 weights (row-major, hence
+* stored as a cols x rows block), the f32 row scales, the f32 biases and the f32 input scale.
+*/
+
+
+namespace nn{
+
+template<class Net>
+class QuantizedNetwork{
+public:
+	typedef typename Net::scalar_type T;
+	typedef typename Net::mat_type mat_type;
+
+	const static size_t layers_n = Net::layers_n;
+	const static size_t input_size = Net::input_size;
+	const static size_t output_size = Net::output_size;
+
+	// Buffers of one predict call, see Network::Context
+	struct Context{
+		std::vector<int8_t> xq; // quantized input of the current layer, one column per input
+		std::vector<float> act; // activations of the current layer
+		mat_type out;
+	};
+
+	// calibration: representative inputs, one per column
+	QuantizedNetwork(const Net & net, const mat_type & calibration){
+		if(calibration.n_rows != input_size || calibration.n_cols == 0) throw std::invalid_argument{"Bad calibration data."};
+
+		typename Net::Context ctx;
+		net.predict(calibration, ctx);
+
+		layers.resize(layers_n-1);
+		for(size_t i = 0; i < layers_n-1; ++i){
+			const mat_type & in = (i == 0) ? calibration : ctx.a[i];
+			quantize_layer(layers[i], net.w[i], net.b[i+1], max_abs(in));
+		}
+	}
+
+	// Loads a file written by save(); the int8 weights are used directly from the mapped file
+	explicit QuantizedNetwork(const std::string & file){
+		mapping = std::make_shared<MappedModelFile>(file);
+
+		auto && h = mapping->header();
+		if(h.layers_n != layers_n) throw std::runtime_error{"Wrong topology."};
+
+		layers.resize(layers_n-1);
+		for(size_t i = 0; i < layers_n-1; ++i){
+			size_t rows = h.sizes[i+1], cols = h.sizes[i];
+			if(rows != sizes()[i+1] || cols != sizes()[i]) throw std::runtime_error{"Wrong topology."};
+
+			Layer & l = layers[i];
+			l.rows = rows;
+			l.cols = cols;
+			l.mapped_wq = mapping->data<int8_t>(4*i, cols, rows); // row-major, i.e. a column-major cols x rows block
+			const float * ws = mapping->data<float>(4*i+1, rows, 1);
+			const float * bs = mapping->data<float>(4*i+2, rows, 1);
+			l.w_scale.assign(ws, ws + rows);
+			l.bias.assign(bs, bs + rows);
+			l.in_scale = *mapping->data<float>(4*i+3, 1, 1);
+		}
+	}
+
+	void save(const std::string & file) const {
+		ModelFileWriter wr(std::vector<size_t>(sizes().begin(), sizes().end()));
+
+		for(auto && l : layers){
+			wr.add_block(l.weights(), l.cols, l.rows);
+			wr.add_block(l.w_scale.data(), l.rows, 1);
+			wr.add_block(l.bias.data(), l.rows, 1);
+			wr.add_block(&l.in_scale, 1, 1);
+		}
+
+		wr.write(file);
+	}
+
+	// Reentrant, like Network::predict
+	const mat_type & predict(const mat_type & input, Context & ctx) const {
+		if(input.n_rows != input_size) throw std::invalid_argument{"Wrong input size."};
+
+		const size_t n = input.n_cols;
+		ctx.out.set_size(output_size, n);
+
+		// Quantize the input
+		ctx.xq.resize(input_size*n);
+		quantize(input.memptr(), input_size*n, layers[0].in_scale, ctx.xq.data());
+
+		for(size_t i = 0; i < layers.size(); ++i){
+			const Layer & l = layers[i];
+			ctx.act.resize(l.rows*n);
+
+			const int8_t * wq = l.weights();
+
+			// Blocks of columns, so that a row of weights is reused from L1 for all inputs of the block
+			for(size_t c0 = 0; c0 < n; c0 += column_block){
+				const size_t c1 = std::min(n, c0 + column_block);
+
+				for(size_t r = 0; r < l.rows; ++r){
+					const float scale = l.w_scale[r]*l.in_scale;
+
+					for(size_t c = c0; c < c1; ++c){
+						int32_t acc = dot(wq + r*l.cols, &ctx.xq[c*l.cols], l.cols);
+						ctx.act[c*l.rows + r] = acc*scale + l.bias[r];
+					}
+				}
+			}
+
+			sigmoid(ctx.act.data(), ctx.act.data(), ctx.act.size());
+
+			if(i + 1 < layers.size()){
+				ctx.xq.resize(l.rows*n);
+				quantize(ctx.act.data(), l.rows*n, layers[i+1].in_scale, ctx.xq.data());
+			}
+		}
+
+		std::copy(ctx.act.begin(), ctx.act.end(), ctx.out.memptr());
+		return ctx.out;
+	}
+
+	// The same with a thread-local context, the result is valid until the next predict call on the same thread
+	const mat_type & predict(const mat_type & input) const {
+		static thread_local Context ctx;
+		return predict(input, ctx);
+	}
+
+	// Memory taken by the quantized weights
+	size_t weight_bytes() const {
+		size_t ret = 0;
+		for(auto && l : layers) ret += l.rows*l.cols;
+		return ret;
+	}
+
+private:
+	const static size_t column_block = 16;
+
+	struct Layer{
+		size_t rows, cols;
+		std::vector<int8_t> own_wq; // row-major, empty if the weights are in the mapped file
+		const int8_t * mapped_wq = nullptr;
+		std::vector<float> w_scale; // per row
+		std::vector<float> bias;
+		float in_scale;
+
+		const int8_t * weights() const {
+			return own_wq.empty() ? mapped_wq : own_wq.data();
+		}
+	};
+
+	std::vector<Layer> layers;
+	std::shared_ptr<MappedModelFile> mapping;
+
+	static const std::array<size_t, 3> & sizes(){
+		static const std::array<size_t, 3> s = { Net::input_size, Net::hidden_size, Net::output_size };
+		return s;
+	}
+
+	static void quantize_layer(Layer & l, const mat_type & w, const typename Net::vec_type & b, float in_max){
+		l.rows = w.n_rows;
+		l.cols = w.n_cols;
+		l.own_wq.resize(l.rows*l.cols);
+		l.w_scale.resize(l.rows);
+		l.bias.assign(b.memptr(), b.memptr() + b.n_elem);
+		l.in_scale = in_max > 0 ? in_max/127 : 1;
+
+		for(size_t r = 0; r < l.rows; ++r){
+			float mx = 0;
+			for(size_t c = 0; c < l.cols; ++c) mx = std::max(mx, (float)std::abs(w(r, c)));
+			l.w_scale[r] = mx > 0 ? mx/127 : 1;
+
+			for(size_t c = 0; c < l.cols; ++c){
+				l.own_wq[r*l.cols + c] = (int8_t)std::lround(w(r, c)/l.w_scale[r]);
+			}
+		}
+	}
+
+	static float max_abs(const mat_type & m){
+		float ret = 0;
+		for(size_t i = 0; i < m.n_elem; ++i) ret = std::max(ret, (float)std::abs(m.memptr()[i]));
+		return ret;
+	}
+
+	template<class S>
+	static void quantize(const S * x, size_t len, float scale, int8_t * out){
+		const float inv = 1/scale;
+		for(size_t i = 0; i < len; ++i){
+			float q = std::nearbyint(x[i]*inv);
+			out[i] = (int8_t)std::min(127.0f, std::max(-127.0f, q));
+		}
+	}
+
+	// Written so that the compiler vectorizes it (int8 products widened and summed into int32 lanes)
+	static int32_t dot(const int8_t * a, const int8_t * b, size_t len){
+		int32_t acc = 0;
+		for(size_t i = 0; i < len; ++i) acc += (int16_t)a[i]*(int16_t)b[i];
+		return acc;
+	}
+};
+
+};
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef _SPECTRUM_HPP
+#define _SPECTRUM_HPP
+
+#include <armadillo>
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <stdexcept>
+
+
+/**
+* Usage: BandSpectrum s(n, bins); // a plan for signals of length n
+* s.magnitudes(x, out); // out = |X[0..bins-1]|, X the n-point DFT of the real signal x
+*
+* Only the lowest bins of the spectrum, without computing the whole FFT. With n = P*Q, column m of
+* a P x Q matrix holds x[m], x[m+Q], x[m+2Q], ... and
+*	X[k] = sum over m of W_n^(m*k) * C_m[k mod P], C_m the P-point DFT of column m, W_n = e^(-2*pi*i/n),
+* so for bins <= P only Q FFTs of length P and bins*Q twiddle multiplications are needed.
+* The columns are real, so two of them are transformed as one complex column (x_a + i*x_b)
+* and separated afterwards by the symmetry of real DFTs.
+*
+* The plan picks P among the divisors of n by a cost model of the mixed-radix FFT (about
+* length*(sum of the prime factors of the length) operations) and falls back to the full FFT
+* if no split is cheaper (e.g. for a prime n).
+*
+* A plan keeps its buffers for the following calls, so magnitudes and transform are not const and a plan
+* must not be used by more threads at once (one plan per thread and length).
+*/
+
+
+namespace nn{
+
+class BandSpectrum{
+public:
+	BandSpectrum(size_t n, size_t bins): n(n), band(bins) {
+		if(n == 0 || bins == 0 || bins > n) throw std::invalid_argument{"Wrong size of the spectrum."};
+
+		double best = fft_cost(n);
+		for(size_t d = bins; d < n; ++d){
+			if(n % d != 0) continue;
+
+			size_t q = n/d;
+			double cost = (q + 1)/2*fft_cost(d) + twiddle_cost*bins*q;
+			if(cost < best){
+				best = cost;
+				p = d;
+			}
+		}
+	}
+
+	size_t size() const { return n; }
+	size_t bins() const { return band; }
+
+	// The length of the partial FFTs, 0 if the full FFT is used
+	size_t split() const { return p; }
+
+	// x has size() values, out is resized to bins()
+	void magnitudes(const double * x, arma::vec & out){
+		transform(x, result);
+
+		out.set_size(band);
+		for(size_t k = 0; k < band; ++k) out[k] = std::abs(result[k]);
+	}
+
+	// The same, the complex X[0..bins-1]
+	void transform(const double * x, std::vector<std::complex<double>> & out){
+		typedef std::complex<double> cx;
+
+		if(p == 0){
+			const arma::vec v(const_cast<double*>(x), n, false, true);
+			f = arma::fft(v);
+			out.assign(f.memptr(), f.memptr() + band);
+			return;
+		}
+
+		const size_t q = n/p, pairs = (q + 1)/2;
+		const double pi = 3.14159265358979323846;
+
+		// Columns 2j and 2j+1 as the real and the imaginary part of column j
+		packed.set_size(p, pairs);
+		for(size_t j = 0; j < pairs; ++j){
+			cx * col = packed.colptr(j);
+			const size_t a = 2*j, b = 2*j + 1;
+			for(size_t r = 0; r < p; ++r) col[r] = cx(x[a + r*q], b < q ? x[b + r*q] : 0.0);
+		}
+
+		f = arma::fft(packed);
+
+		std::vector<cx> & acc = out;
+		acc.assign(band, cx(0));
+		for(size_t j = 0; j < pairs; ++j){
+			const cx * z = f.colptr(j);
+			const size_t a = 2*j, b = 2*j + 1;
+
+			// W_n^(a*k) and W_n^(b*k) by recurrence over k
+			const cx step_a = std::polar(1.0, -2*pi*(double)a/n), step_b = std::polar(1.0, -2*pi*(double)b/n);
+			cx tw_a = 1, tw_b = 1;
+
+			for(size_t k = 0; k < band; ++k){
+				const cx zk = z[k], zr = std::conj(z[(p - k) % p]);
+				const cx ca = 0.5*(zk + zr), cb = cx(0, -0.5)*(zk - zr);
+
+				acc[k] += ca*tw_a;
+				if(b < q) acc[k] += cb*tw_b;
+
+				tw_a *= step_a;
+				tw_b *= step_b;
+			}
+		}
+	}
+
+private:
+	// A twiddle multiplication (with the separation of the packed columns) relative to an FFT operation
+	constexpr static double twiddle_cost = 4;
+
+	size_t n, band;
+	size_t p = 0;
+
+	arma::cx_mat packed, f; // the buffers of transform
+	std::vector<std::complex<double>> result; // of magnitudes
+
+	static double fft_cost(size_t len){
+		size_t sum = 0, rest = len;
+		for(size_t f = 2; f*f <= rest; ++f){
+			while(rest % f == 0){
+				sum += f;
+				rest /= f;
+			}
+		}
+		if(rest > 1) sum += rest;
+		return (double)len*sum;
+	}
+};
+
+
+/**
+* Usage: SlidingSpectrum s(n, bins); s.push(samples, count); ... s.hann_magnitudes(out);
+*
+* The lowest bins of the DFT of the last n samples of a stream, updated with every sample by the sliding
+* DFT: X_k <- (X_k + x_new - x_old)*e^(2*pi*i*k/n), i.e. bins operations per sample instead of a transform
+* per window, so the spectrum is ready as soon as a sample arrives. The samples are kept in a ring buffer
+* of n values, before n samples arrive the missing ones are zeros. The rounding errors of the recurrence
+* are removed by recomputing the bins exactly (BandSpectrum) every resync samples.
+*/
+class SlidingSpectrum{
+public:
+	SlidingSpectrum(size_t n, size_t bins, size_t resync = 0 /* 0 - 64*n */):
+			n(n), band(bins), resync(resync ? resync : 64*n), exact(n, bins + 1), ring(n, 0.0), ordered(n),
+			re(bins + 1, 0.0), im(bins + 1, 0.0), cr(bins + 1), ci(bins + 1) {
+		const double pi = 3.14159265358979323846;
+
+		// One bin more for the Hann window (see hann_magnitudes)
+		for(size_t k = 0; k <= bins; ++k){
+			cr[k] = std::cos(2*pi*k/n);
+			ci[k] = std::sin(2*pi*k/n);
+		}
+	}
+
+	size_t size() const { return n; }
+	size_t bins() const { return band; }
+
+	// The number of samples pushed so far
+	size_t samples() const { return pushed; }
+
+	template<class S>
+	void push(const S * x, size_t count){
+		const size_t b = band + 1;
+		double * const r = re.data(), * const i = im.data();
+		const double * const c = cr.data(), * const s = ci.data();
+
+		for(size_t j = 0; j < count; ++j){
+			const double v = (double)x[j];
+			const double d = v - ring[pos];
+			ring[pos] = v;
+			if(++pos == n) pos = 0;
+
+			for(size_t k = 0; k < b; ++k){
+				const double a = r[k] + d;
+				r[k] = a*c[k] - i[k]*s[k];
+				i[k] = a*s[k] + i[k]*c[k];
+			}
+
+			if(++pushed % resync == 0) sync();
+		}
+	}
+
+	// |X[0..bins-1]| of the last n samples (rectangular window)
+	void magnitudes(arma::vec & out) const {
+		out.set_size(band);
+		for(size_t k = 0; k < band; ++k) out[k] = std::hypot(re[k], im[k]);
+	}
+
+	// The same with the (periodic) Hann window 0.5 - 0.5*cos(2*pi*m/n), applied in the frequency domain:
+	// 0.5*X_k - 0.25*(X_k-1 + X_k+1), where X_-1 is the conjugate of X_1 (the signal is real)
+	void hann_magnitudes(arma::vec & out) const {
+		out.set_size(band);
+		for(size_t k = 0; k < band; ++k){
+			double prev_r = k ? re[k-1] : re[1], prev_i = k ? im[k-1] : -im[1];
+			double hr = 0.5*re[k] - 0.25*(prev_r + re[k+1]);
+			double hi = 0.5*im[k] - 0.25*(prev_i + im[k+1]);
+			out[k] = std::hypot(hr, hi);
+		}
+	}
+
+private:
+	size_t n, band, resync;
+	BandSpectrum exact;
+
+	std::vector<double> ring, ordered;
+	size_t pos = 0; // the oldest sample, the next to be replaced
+	size_t pushed = 0;
+
+	std::vector<double> re, im; // the bins 0..band
+	std::vector<double> cr, ci; // e^(2*pi*i*k/n)
+
+	std::vector<std::complex<double>> synced;
+
+	void sync(){
+		std::copy(ring.begin() + pos, ring.end(), ordered.begin());
+		std::copy(ring.begin(), ring.begin() + pos, ordered.begin() + (n - pos));
+
+		exact.transform(ordered.data(), synced);
+		for(size_t k = 0; k <= band; ++k){
+			re[k] = synced[k].real();
+			im[k] = synced[k].imag();
+		}
+	}
+};
+
+};
+
+#endif
@@ -0,0 +1,561 @@
+#ifndef _TRAINING_DATA_HPP
+#define _TRAINING_DATA_HPP
+
+#include <armadillo>
+#include <array>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "model_file.hpp"
+
+
+/**
+* Usage: gd.set_training_data({inputs, outputs}); // in memory, as before
+* gd.set_data_source(std::make_unique<StreamingDataSource<T>>(file)); // from the disk
+* gd.set_data_source(std::make_unique<ShuffledDataSource<T>>(std::move(source))); // any of them shuffled every epoch
+*
+* Sources of the training data of GradientDescent. The training asks for the minibatches of every
+* epoch in increasing order (with more threads, several neighbouring ones are held at once) and releases
+* each one when it is done with it, so a source only has to keep a window of minibatches in memory.
+*
+* Training data file (written by TrainingDataWriter, numbers in the byte order of the machine which wrote it):
+* a header (see TrainingDataHeader: magic "NNDATA\0\0", version, endianness marker, dtype of the values,
+* input and output size and the number of samples), the inputs as one column-major input_size x count
+* matrix and then the outputs as an output_size x count one, both aligned to block_alignment bytes.
+* The values are stored as f32 or f64 and converted to the scalar type of the network when read.
+*/
+
+
+namespace nn{
+
+// cols inputs and expected outputs, column-major and contiguous
+template<class T>
+struct TrainingBatch{
+	const T * input;
+	const T * output;
+	size_t cols;
+};
+
+template<class T>
+class TrainingDataSource{
+public:
+	virtual ~TrainingDataSource() {}
+
+	// The number of samples and their sizes
+	virtual size_t size() const = 0;
+	virtual size_t input_size() const = 0;
+	virtual size_t output_size() const = 0;
+
+	// Called before the minibatches of an epoch are acquired, when all the previous ones are released.
+	// There are size()/batch_size minibatches, the remaining samples are not used.
+	virtual void start_epoch(size_t batch_size) = 0;
+
+	// The minibatch batch_i (samples batch_i*batch_size...), valid until release(batch_i). Thread-safe.
+	virtual TrainingBatch<T> acquire(size_t batch_i) = 0;
+	virtual void release(size_t batch_i) = 0;
+
+	// Random access: the samples idx[0..n-1] as the columns of input (input_size() x n) and output. Thread-safe.
+	virtual void copy_samples(const size_t * idx, size_t n, T * input, T * output) = 0;
+};
+
+
+// The whole data set in two matrices (inputs and outputs, one sample per column)
+template<class T>
+class InMemoryDataSource : public TrainingDataSource<T> {
+public:
+	explicit InMemoryDataSource(std::array<arma::Mat<T>, 2> data): data(std::move(data)) {
+		if(this->data[0].n_cols != this->data[1].n_cols) throw std::invalid_argument{"Different numbers of inputs and outputs."};
+	}
+
+	size_t size() const override { return data[0].n_cols; }
+	size_t input_size() const override { return data[0].n_rows; }
+	size_t output_size() const override { return data[1].n_rows; }
+
+	void start_epoch(size_t bs) override {
+		batch_size = bs;
+	}
+
+	TrainingBatch<T> acquire(size_t batch_i) override {
+		size_t start = batch_i*batch_size;
+		return TrainingBatch<T>{ data[0].colptr(start), data[1].colptr(start), batch_size };
+	}
+
+	void release(size_t) override {}
+
+	void copy_samples(const size_t * idx, size_t n, T * input, T * output) override {
+		const size_t is = input_size(), os = output_size();
+		for(size_t i = 0; i < n; ++i){
+			std::memcpy(input + i*is, data[0].colptr(idx[i]), is*sizeof(T));
+			std::memcpy(output + i*os, data[1].colptr(idx[i]), os*sizeof(T));
+		}
+	}
+
+private:
+	std::array<arma::Mat<T>, 2> data;
+	size_t batch_size = 0;
+};
+
+
+const uint32_t training_data_version = 1;
+
+struct TrainingDataHeader{
+	char magic[8];
+	uint32_t version;
+	uint32_t endianness;
+	uint32_t dtype;
+	uint32_t reserved;
+	uint64_t input_size, output_size, count;
+};
+
+static_assert(sizeof(TrainingDataHeader) == 48, "Unexpected padding in TrainingDataHeader.");
+
+namespace detail{
+
+	const char training_data_magic[8] = { 'N', 'N', 'D', 'A', 'T', 'A', '\0', '\0' };
+
+	// Offsets of the input and output matrices in the file
+	inline size_t inputs_offset(){
+		return align_up(sizeof(TrainingDataHeader));
+	}
+
+	inline size_t outputs_offset(const TrainingDataHeader & h){
+		return align_up(inputs_offset() + h.input_size*h.count*dtype_size((DType)h.dtype));
+	}
+
+	// pread/pwrite until everything is transferred
+	inline bool read_at(int fd, void * buf, size_t len, size_t offset){
+		char * p = (char*)buf;
+		while(len){
+			ssize_t r = ::pread(fd, p, len, (off_t)offset);
+			if(r <= 0) return false;
+			p += r; len -= r; offset += r;
+		}
+		return true;
+	}
+
+	inline bool write_at(int fd, const void * buf, size_t len, size_t offset){
+		const char * p = (const char*)buf;
+		while(len){
+			ssize_t r = ::pwrite(fd, p, len, (off_t)offset);
+			if(r <= 0) return false;
+			p += r; len -= r; offset += r;
+		}
+		return true;
+	}
+
+};
+
+
+/**
+* Usage: TrainingDataWriter<float> wr(file, input_size, output_size, count);
+* wr.write(inputs, outputs); ... // chunks of samples (columns), count in total
+* wr.close();
+*
+* Writes a training data file with values of type S chunk by chunk, so a data set larger
+* than the memory can be produced (e.g. from a stream of preprocessed samples).
+*/
+template<class S>
+class TrainingDataWriter{
+public:
+	TrainingDataWriter(const std::string & file, size_t input_size, size_t output_size, size_t count): file(file) {
+		std::memset(&h, 0, sizeof(h));
+		std::memcpy(h.magic, detail::training_data_magic, 8);
+		h.version = training_data_version;
+		h.endianness = endianness_marker;
+		h.dtype = (uint32_t)dtype_of<S>::value;
+		h.input_size = input_size;
+		h.output_size = output_size;
+		h.count = count;
+
+		fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0) throw std::runtime_error{"Cannot create the training data file."};
+
+		if(!detail::write_at(fd, &h, sizeof(h), 0)) fail();
+	}
+
+	~TrainingDataWriter(){
+		if(fd >= 0) ::close(fd);
+	}
+
+	TrainingDataWriter(const TrainingDataWriter &) = delete;
+	TrainingDataWriter & operator=(const TrainingDataWriter &) = delete;
+
+	// The next inputs.n_cols samples
+	template<class T>
+	void write(const arma::Mat<T> & inputs, const arma::Mat<T> & outputs){
+		if(inputs.n_rows != h.input_size || outputs.n_rows != h.output_size || inputs.n_cols != outputs.n_cols){
+			throw std::invalid_argument{"Wrong size of the training data."};
+		}
+		if(written + inputs.n_cols > h.count) throw std::invalid_argument{"More samples than announced."};
+
+		write_block(inputs, detail::inputs_offset() + written*h.input_size*sizeof(S));
+		write_block(outputs, detail::outputs_offset(h) + written*h.output_size*sizeof(S));
+		written += inputs.n_cols;
+	}
+
+	void close(){
+		if(written != h.count) throw std::runtime_error{"Fewer samples than announced."};
+
+		// The file has its full length even if the outputs are empty
+		size_t end = detail::outputs_offset(h) + h.output_size*h.count*sizeof(S);
+		if(::ftruncate(fd, (off_t)end) != 0 || ::close(fd) != 0){
+			fd = -1;
+			fail();
+		}
+		fd = -1;
+	}
+
+private:
+	std::string file;
+	TrainingDataHeader h;
+	int fd;
+	size_t written = 0;
+	std::vector<S> buf;
+
+	template<class T>
+	void write_block(const arma::Mat<T> & m, size_t offset){
+		const S * p = (const S*)m.memptr();
+		if(!std::is_same<S, T>::value){
+			buf.assign(m.memptr(), m.memptr() + m.n_elem);
+			p = buf.data();
+		}
+		if(!detail::write_at(fd, p, m.n_elem*sizeof(S), offset)) fail();
+	}
+
+	void fail(){
+		if(fd >= 0) ::close(fd);
+		fd = -1;
+		std::remove(file.c_str());
+		throw std::runtime_error{"Cannot write the training data file."};
+	}
+};
+
+// The whole data set at once
+template<class S, class T>
+void save_training_data(const std::string & file, const arma::Mat<T> & inputs, const arma::Mat<T> & outputs){
+	TrainingDataWriter<S> wr(file, inputs.n_rows, outputs.n_rows, inputs.n_cols);
+	wr.write(inputs, outputs);
+	wr.close();
+}
+
+
+/**
+* A source which prepares the minibatches of every epoch in order on a background thread (by load(),
+* implemented by the subclasses) into a ring of slots: at most slots minibatches ahead of the oldest one
+* still in use. Memory: slots*batch_size*(input_size + output_size) values.
+* As long as load() keeps up, the training does not wait for it, the loading overlaps the computation.
+*/
+template<class T>
+class PrefetchingDataSource : public TrainingDataSource<T> {
+public:
+	explicit PrefetchingDataSource(size_t slots): slots(std::max<size_t>(slots, 1)) {}
+
+	~PrefetchingDataSource(){
+		stop();
+	}
+
+	void start_epoch(size_t bs) override {
+		cancel_epoch();
+
+		batch_size = bs;
+		batches = bs ? this->size()/bs : 0;
+		error = nullptr;
+		for(auto && s : slots){
+			s.state = Slot::free;
+			s.input.resize(bs*this->input_size());
+			s.output.resize(bs*this->output_size());
+		}
+
+		begin_epoch();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			++epoch;
+			loading = true;
+		}
+		cv.notify_all();
+
+		// One thread for all the epochs, a new one would be allocated every epoch
+		if(!loader.joinable()) loader = std::thread([this] () { loader_loop(); });
+	}
+
+	TrainingBatch<T> acquire(size_t batch_i) override {
+		Slot & s = slots[batch_i % slots.size()];
+
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&] () { return (s.batch == batch_i && s.state == Slot::ready) || error; });
+		if(error) std::rethrow_exception(error);
+
+		s.state = Slot::in_use;
+		return TrainingBatch<T>{ s.input.data(), s.output.data(), batch_size };
+	}
+
+	void release(size_t batch_i) override {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			slots[batch_i % slots.size()].state = Slot::free;
+		}
+		cv.notify_all();
+	}
+
+protected:
+	size_t batch_size = 0;
+
+	// Called on the calling thread of start_epoch, before the loading starts
+	virtual void begin_epoch() {}
+
+	// Fills the buffers (input_size x batch_size and output_size x batch_size) with the minibatch batch_i,
+	// called on the background thread in the order of the minibatches. May throw, acquire() rethrows it.
+	virtual void load(size_t batch_i, T * input, T * output) = 0;
+
+	// Stops the background thread; subclasses call it in their destructors, before load() stops being callable
+	void stop(){
+		if(!loader.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		cv.notify_all();
+		loader.join();
+	}
+
+private:
+	// Makes the background thread give up the current epoch and waits until it does
+	void cancel_epoch(){
+		std::unique_lock<std::mutex> lock(mutex);
+		cancel = true;
+		cv.notify_all();
+		cv.wait(lock, [this] () { return !loading; });
+		cancel = false;
+	}
+
+	struct Slot{
+		enum State { free, loading, ready, in_use };
+
+		State state = free;
+		size_t batch = 0;
+		std::vector<T> input, output;
+	};
+
+	size_t batches = 0;
+	std::vector<Slot> slots; // batch i is loaded into slots[i % slots.size()]
+
+	std::thread loader;
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool quit = false;
+	size_t epoch = 0; // started by start_epoch
+	bool loading = false; // the background thread is loading the last epoch
+	bool cancel = false;
+	std::exception_ptr error;
+
+	void loader_loop(){
+		size_t seen = 0;
+		while(true){
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&] () { return epoch != seen || quit; });
+				if(quit) return;
+				seen = epoch;
+			}
+
+			load_epoch();
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				loading = false;
+			}
+			cv.notify_all();
+		}
+	}
+
+	void load_epoch(){
+		for(size_t i = 0; i < batches; ++i){
+			Slot & s = slots[i % slots.size()];
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&] () { return s.state == Slot::free || quit || cancel; });
+				if(quit || cancel) return;
+				s.state = Slot::loading;
+				s.batch = i;
+			}
+
+			try{
+				load(i, s.input.data(), s.output.data());
+			}
+			catch(...){
+				std::lock_guard<std::mutex> lock(mutex);
+				error = std::current_exception();
+				cv.notify_all();
+				return;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				s.state = Slot::ready;
+			}
+			cv.notify_all();
+		}
+	}
+};
+
+
+/**
+* Reads the minibatches from a training data file, prefetch minibatches ahead (see PrefetchingDataSource),
+* regardless of the size of the file. The reads overlap the computation and the file is read sequentially
+* (the kernel's readahead is asked for). copy_samples reads every sample separately, so a shuffled
+* streaming source does random reads, which only pays off on an SSD or with the file in the page cache.
+*/
+template<class T>
+class StreamingDataSource : public PrefetchingDataSource<T> {
+public:
+	explicit StreamingDataSource(const std::string & file, size_t prefetch = 16): PrefetchingDataSource<T>(prefetch) {
+		fd = ::open(file.c_str(), O_RDONLY);
+		if(fd < 0) throw std::runtime_error{"Cannot open the training data file."};
+
+		try{
+			if(!detail::read_at(fd, &h, sizeof(h), 0)) throw std::runtime_error{"Truncated training data file."};
+			validate();
+		}
+		catch(...){
+			::close(fd);
+			throw;
+		}
+
+#ifdef POSIX_FADV_SEQUENTIAL
+		::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	}
+
+	~StreamingDataSource(){
+		this->stop();
+		::close(fd);
+	}
+
+	StreamingDataSource(const StreamingDataSource &) = delete;
+	StreamingDataSource & operator=(const StreamingDataSource &) = delete;
+
+	size_t size() const override { return h.count; }
+	size_t input_size() const override { return h.input_size; }
+	size_t output_size() const override { return h.output_size; }
+
+	void copy_samples(const size_t * idx, size_t n, T * input, T * output) override {
+		static thread_local std::vector<char> buf; // reused by the following calls on the thread (it can be called concurrently)
+		for(size_t i = 0; i < n; ++i){
+			read_values(input + i*h.input_size, detail::inputs_offset(), h.input_size, idx[i], 1, buf);
+			read_values(output + i*h.output_size, detail::outputs_offset(h), h.output_size, idx[i], 1, buf);
+		}
+	}
+
+protected:
+	void load(size_t batch_i, T * input, T * output) override {
+		const size_t bs = this->batch_size;
+		read_values(input, detail::inputs_offset(), h.input_size, batch_i*bs, bs, raw);
+		read_values(output, detail::outputs_offset(h), h.output_size, batch_i*bs, bs, raw);
+	}
+
+private:
+	int fd;
+	TrainingDataHeader h;
+	std::vector<char> raw; // the loader's buffer for values of another type than T
+
+	void validate() const {
+		if(std::memcmp(h.magic, detail::training_data_magic, 8) != 0) throw std::runtime_error{"Not a training data file."};
+		if(h.endianness != endianness_marker) throw std::runtime_error{"The training data file has a different endianness."};
+		if(h.version != training_data_version) throw std::runtime_error{"Unsupported training data file version."};
+		if(h.dtype != (uint32_t)DType::f32 && h.dtype != (uint32_t)DType::f64) throw std::runtime_error{"Wrong dtype in the training data file."};
+
+		struct stat st;
+		size_t end = detail::outputs_offset(h) + h.output_size*h.count*dtype_size((DType)h.dtype);
+		if(::fstat(fd, &st) != 0 || (size_t)st.st_size < end) throw std::runtime_error{"Truncated training data file."};
+	}
+
+	// cols columns of rows values from the matrix at offset, starting with the column start
+	void read_values(T * out, size_t offset, size_t rows, size_t start, size_t cols, std::vector<char> & buf) const {
+		size_t n = rows*cols;
+
+		if(h.dtype == (uint32_t)dtype_of<T>::value){
+			if(!detail::read_at(fd, out, n*sizeof(T), offset + start*rows*sizeof(T))) throw std::runtime_error{"Cannot read the training data file."};
+		}
+		else if(h.dtype == (uint32_t)DType::f32){
+			convert<float>(out, offset, n, start*rows, buf);
+		}
+		else{
+			convert<double>(out, offset, n, start*rows, buf);
+		}
+	}
+
+	template<class S>
+	void convert(T * out, size_t offset, size_t n, size_t first, std::vector<char> & buf) const {
+		buf.resize(n*sizeof(S));
+		if(!detail::read_at(fd, buf.data(), n*sizeof(S), offset + first*sizeof(S))) throw std::runtime_error{"Cannot read the training data file."};
+
+		for(size_t i = 0; i < n; ++i){
+			S x;
+			std::memcpy(&x, &buf[i*sizeof(S)], sizeof(S));
+			out[i] = (T)x;
+		}
+	}
+};
+
+
+/**
+* Another source in a new random order every epoch: a fresh permutation of the samples is drawn
+* at the start of the epoch and a background thread gathers the samples of the next minibatches
+* into contiguous buffers (copy_samples of the wrapped source) while the current ones are trained on.
+* buffers = 2 is double buffering; with more training threads (hogwild) use at least threads + 1.
+* The data set itself is never permuted.
+*/
+template<class T>
+class ShuffledDataSource : public PrefetchingDataSource<T> {
+public:
+	explicit ShuffledDataSource(std::unique_ptr<TrainingDataSource<T>> source, size_t buffers = 2, unsigned seed = 1):
+			PrefetchingDataSource<T>(std::max<size_t>(buffers, 2)), source(std::move(source)), gen(seed) {
+		perm.resize(this->source->size());
+		std::iota(perm.begin(), perm.end(), size_t(0));
+	}
+
+	~ShuffledDataSource(){
+		this->stop();
+	}
+
+	size_t size() const override { return source->size(); }
+	size_t input_size() const override { return source->input_size(); }
+	size_t output_size() const override { return source->output_size(); }
+
+	void copy_samples(const size_t * idx, size_t n, T * input, T * output) override {
+		source->copy_samples(idx, n, input, output);
+	}
+
+protected:
+	void begin_epoch() override {
+		std::shuffle(perm.begin(), perm.end(), gen);
+	}
+
+	void load(size_t batch_i, T * input, T * output) override {
+		source->copy_samples(&perm[batch_i*this->batch_size], this->batch_size, input, output);
+	}
+
+private:
+	std::unique_ptr<TrainingDataSource<T>> source;
+	std::vector<size_t> perm;
+	std::mt19937 gen;
+};
+
+};
+
+#endif
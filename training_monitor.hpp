@@ -0,0 +1,146 @@
+#ifndef _TRAINING_MONITOR_HPP
+#define _TRAINING_MONITOR_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <ostream>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+
+
+/**
+* Usage: gd.set_monitor([] (const nn::EpochStats & s) { ... });
+* or gd.set_monitor(nn::JsonLinesSink("training.jsonl")); // one JSON object per epoch and line
+*
+* What GradientDescent::train did in an epoch and where the time went. Without a monitor nothing
+* is measured (only a flag is tested per phase), with one there are a few clock reads per minibatch
+* and layer.
+*
+* The phase times are summed over the threads, so with more threads they add up to more than the wall time:
+* data - acquiring the minibatches from the data source (waiting for the prefetching loader included)
+* forward, backward - the passes of the backpropagation (the cost and its derivative count as backward)
+* update - the optimizer step
+* checkpoint - copying the state for the checkpoint writer (the writing itself runs in the background)
+* callback - the after_epoch function of train (e.g. the evaluation), on the training thread
+*
+* Layer i is the one with the weights w[i] (sizes[i+1] x sizes[i]). Its FLOPs are those of the matrix
+* products (2*rows*cols per sample and product: one forward, one or two backward), the bias and
+* the sigmoid are not counted. Per-layer times are measured only by the batched engine.
+*/
+
+
+namespace nn{
+
+struct PhaseTimes{
+	double data = 0, forward = 0, backward = 0, update = 0, checkpoint = 0, callback = 0; // s
+
+	PhaseTimes & operator+=(const PhaseTimes & o){
+		data += o.data; forward += o.forward; backward += o.backward; update += o.update;
+		checkpoint += o.checkpoint; callback += o.callback;
+		return *this;
+	}
+};
+
+struct LayerStats{
+	size_t rows = 0, cols = 0;
+	double forward_flops = 0, backward_flops = 0;
+	double forward_time = 0, backward_time = 0; // s, summed over the threads
+
+	double forward_gflops() const { return forward_time > 0 ? forward_flops/forward_time*1e-9 : 0; }
+	double backward_gflops() const { return backward_time > 0 ? backward_flops/backward_time*1e-9 : 0; }
+};
+
+struct EpochStats{
+	size_t epoch = 0;
+	size_t samples = 0;
+	size_t threads = 1;
+	double eta = 0; // the learning rate of the epoch
+	double loss = 0; // the average cost per sample
+	double wall_time = 0; // s, the whole epoch including the callback
+	PhaseTimes phases;
+	std::vector<LayerStats> layers;
+	bool allocations_counted = false; // only in programs counting them, see allocation_counter.hpp
+	size_t allocations = 0; // heap allocations of all the threads from the start of the epoch to the last minibatch
+	size_t workspace_reallocations = 0; // buffers of the training workspaces (re)allocated in the epoch
+
+	double samples_per_second() const {
+		return wall_time > 0 ? samples/wall_time : 0;
+	}
+};
+
+typedef std::function<void(const EpochStats &)> TrainingMonitor;
+
+
+// Writes every EpochStats as one line of JSON, to a stream (which has to outlive the sink) or a file
+class JsonLinesSink{
+public:
+	explicit JsonLinesSink(std::ostream & out): out(&out) {}
+
+	explicit JsonLinesSink(const std::string & file): file(std::make_shared<std::ofstream>(file, std::ios::app)), out(this->file.get()) {
+		if(!*this->file) throw std::runtime_error{"Cannot open the training log " + file + "."};
+	}
+
+	void operator()(const EpochStats & s) const {
+		std::ostream & o = *out;
+		o << "{\"epoch\": " << s.epoch << ", \"samples\": " << s.samples << ", \"threads\": " << s.threads
+			<< ", \"eta\": " << s.eta << ", \"loss\": " << s.loss
+			<< ", \"wall_s\": " << s.wall_time << ", \"samples_per_s\": " << s.samples_per_second()
+			<< ", \"phases_s\": {\"data\": " << s.phases.data << ", \"forward\": " << s.phases.forward
+			<< ", \"backward\": " << s.phases.backward << ", \"update\": " << s.phases.update
+			<< ", \"checkpoint\": " << s.phases.checkpoint << ", \"callback\": " << s.phases.callback << "}, \"layers\": [";
+
+		for(size_t i = 0; i < s.layers.size(); ++i){
+			const LayerStats & l = s.layers[i];
+			o << (i ? ", " : "") << "{\"rows\": " << l.rows << ", \"cols\": " << l.cols
+				<< ", \"forward_gflops\": " << l.forward_gflops() << ", \"backward_gflops\": " << l.backward_gflops() << "}";
+		}
+
+		o << "], \"allocations\": ";
+		if(s.allocations_counted) o << s.allocations;
+		else o << "null";
+		o << ", \"workspace_reallocations\": " << s.workspace_reallocations << "}" << std::endl;
+	}
+
+private:
+	std::shared_ptr<std::ofstream> file; // shared, so that the sink can be copied into a TrainingMonitor
+	std::ostream * out;
+};
+
+
+namespace detail{
+
+	// Adds the time since the previous lap to a counter, does nothing if it is not enabled
+	class Stopwatch{
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		explicit Stopwatch(bool enabled): enabled(enabled) {
+			if(enabled) last = Clock::now();
+		}
+
+		void lap(double & counter){
+			if(!enabled) return;
+
+			Clock::time_point now = Clock::now();
+			counter += std::chrono::duration<double>(now - last).count();
+			last = now;
+		}
+
+		// Starts the next lap now, e.g. after a part timed by someone else
+		void restart(){
+			if(enabled) last = Clock::now();
+		}
+
+	private:
+		bool enabled;
+		Clock::time_point last;
+	};
+
+};
+
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include "voice_feature_extractor.hpp"
+#include "voice_processor.hpp"
+#include "spectrum.hpp"
+#include "worker_pool.hpp"
+#include <armadillo>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <cstdint>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+
+struct VoiceFeatureExtractor::ThreadState{
+	std::map<size_t, std::unique_ptr<nn::BandSpectrum>> plans; // by the length of the file
+	std::vector<int16_t> raw;
+	std::vector<double> samples;
+	arma::vec magnitudes;
+};
+
+
+VoiceFeatureExtractor::VoiceFeatureExtractor(size_t sample_rate /* Hz */, size_t threads):
+	sample_rate(sample_rate), pool(threads), states(pool.size()) {
+
+	if(sample_rate < 2*VoiceProcessor::max_human_voice_frequency) throw std::invalid_argument{"Too low sample rate."};
+}
+
+
+VoiceFeatureExtractor::~VoiceFeatureExtractor() = default; // ThreadState is complete only here
+
+
+std::vector<VoiceFeatureExtractor::Result> VoiceFeatureExtractor::extract(const std::vector<Item> & items){
+	std::vector<Result> results(items.size());
+
+	// The longest files first, so that the short ones fill the gaps at the end
+	std::vector<std::pair<off_t, size_t>> order(items.size());
+	for(size_t i = 0; i < items.size(); ++i){
+		struct stat st;
+		order[i] = {::stat(items[i].file.c_str(), &st) == 0 ? st.st_size : 0, i};
+	}
+	std::sort(order.begin(), order.end(), [] (auto && a, auto && b) { return a.first > b.first; });
+
+	nn::parallel_for(pool, order.size(), [&] (size_t i, size_t thread_i) {
+		size_t item_i = order[i].second;
+		process(items[item_i], states[thread_i], results[item_i]);
+	});
+
+	return results;
+}
+
+
+void VoiceFeatureExtractor::process(const Item & item, ThreadState & state, Result & result){
+	result.file = item.file;
+	result.label = item.label;
+	result.ok = false;
+
+	try{
+		int fd = ::open(item.file.c_str(), O_RDONLY);
+		if(fd < 0) throw std::runtime_error{"Cannot open the voice file " + item.file + "."};
+
+		struct stat st;
+		if(::fstat(fd, &st) != 0){
+			::close(fd);
+			throw std::runtime_error{"Cannot read the voice file " + item.file + "."};
+		}
+
+		size_t len = (size_t)st.st_size/sizeof(int16_t);
+		state.raw.resize(len);
+
+		size_t done = 0, bytes = len*sizeof(int16_t);
+		while(done < bytes){
+			ssize_t r = ::read(fd, (char*)state.raw.data() + done, bytes - done);
+			if(r <= 0) break;
+			done += (size_t)r;
+		}
+		::close(fd);
+		if(done < bytes) throw std::runtime_error{"Cannot read the voice file " + item.file + "."};
+
+		double sample_length = (double)len/sample_rate;
+		size_t bins = VoiceProcessor::spectrum_bins(sample_length);
+		if(len < 2 || bins > len) throw std::runtime_error{"The voice file " + item.file + " is too short."};
+
+		state.samples.resize(len);
+		std::copy(state.raw.begin(), state.raw.end(), state.samples.begin());
+
+		auto plan = state.plans.find(len);
+		if(plan == state.plans.end()){
+			if(state.plans.size() >= plans_per_thread) state.plans.clear();
+			plan = state.plans.emplace(len, std::unique_ptr<nn::BandSpectrum>(new nn::BandSpectrum(len, bins))).first;
+		}
+		plan->second->magnitudes(state.samples.data(), state.magnitudes);
+
+		result.properties = VoiceProcessor(state.magnitudes, sample_length).properties;
+		result.ok = true;
+	}
+	catch(const std::exception & e){
+		result.error = e.what();
+	}
+}
+
+
+std::vector<VoiceFeatureExtractor::Item> VoiceFeatureExtractor::list_directory(const std::string & dir){
+	std::vector<Item> items;
+
+	auto add = [&items] (const std::string & d, int label, bool required) {
+		DIR * dp = ::opendir(d.c_str());
+		if(!dp){
+			if(required) throw std::runtime_error{"Cannot open the directory " + d + "."};
+			return;
+		}
+
+		size_t first = items.size();
+		while(dirent * e = ::readdir(dp)){
+			std::string name = e->d_name;
+			if(name.size() > 4 && name.compare(name.size() - 4, 4, ".raw") == 0){
+				items.push_back(Item{d + "/" + name, label});
+			}
+		}
+		::closedir(dp);
+
+		std::sort(items.begin() + first, items.end(), [] (auto && a, auto && b) { return a.file < b.file; });
+	};
+
+	add(dir + "/male", 0, false);
+	add(dir + "/female", 1, false);
+	add(dir, -1, true);
+
+	return items;
+}
+
+
+std::vector<VoiceFeatureExtractor::Item> VoiceFeatureExtractor::read_list(const std::string & file){
+	std::ifstream in(file);
+	if(!in) throw std::runtime_error{"Cannot open the file list " + file + "."};
+
+	std::vector<Item> items;
+	std::string line;
+	while(std::getline(in, line)){
+		std::istringstream ls(line);
+		Item item{"", -1};
+		if(!(ls >> item.file)) continue; // an empty line
+		if(!(ls >> item.label)) item.label = -1;
+		items.push_back(std::move(item));
+	}
+
+	return items;
+}
+
+
+void VoiceFeatureExtractor::write(const std::string & file, const std::vector<Result> & results){
+	std::ofstream out(file);
+	if(!out) throw std::runtime_error{"Cannot write the feature file " + file + "."};
+
+	std::vector<const Result *> lines;
+	for(auto && r : results){
+		if(r.ok) lines.push_back(&r);
+	}
+
+	std::mt19937 rng(shuffle_seed);
+	std::shuffle(lines.begin(), lines.end(), rng);
+
+	out.precision(17);
+	for(const Result * r : lines){
+		for(auto && p : r->properties) out << p << " ";
+		out << r->label << "\n";
+	}
+
+	if(!out.flush()) throw std::runtime_error{"Cannot write the feature file " + file + "."};
+}
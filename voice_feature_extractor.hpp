@@ -0,0 +1,83 @@
+#ifndef _VOICE_FEATURE_EXTRACTOR_HPP
+#define _VOICE_FEATURE_EXTRACTOR_HPP
+
+#include "voice_processor.hpp"
+#include "worker_pool.hpp"
+#include <string>
+#include <vector>
+#include <array>
+
+
+/**
+* Usage: VoiceFeatureExtractor e(44100, threads);
+* auto results = e.extract(VoiceFeatureExtractor::list_directory("voices"));
+* VoiceFeatureExtractor::write("voice_features", results); // VoiceRecognitionNet net("voice_features");
+*
+* The VoiceProcessor properties of many raw files (the format of VoiceProcessor, each one processed whole)
+* at once. The files are processed in parallel, longest first, by a work-stealing parallel_for, so a few long
+* recordings do not leave the other threads idle at the end. Every thread keeps its own buffers and its own
+* spectrum plans (BandSpectrum) for the lengths it has seen, so files of the same length (typical for a data set
+* cut into samples) share a plan and nothing is allocated per file once the buffers are large enough.
+*
+* A file which cannot be read is reported in its Result, the others are processed anyway.
+*/
+
+
+class VoiceFeatureExtractor{
+public:
+	typedef std::array<double, VoiceProcessor::property_cnt> Properties;
+
+	struct Item{
+		std::string file;
+		int label; // 0 - male, 1 - female (as in voice_gender_data), -1 - unknown
+	};
+
+	struct Result{
+		std::string file;
+		int label;
+		Properties properties;
+		bool ok;
+		std::string error; // if not ok
+	};
+
+	VoiceFeatureExtractor(size_t sample_rate /* Hz */, size_t threads = std::thread::hardware_concurrency());
+	~VoiceFeatureExtractor();
+
+	// The results in the order of items
+	std::vector<Result> extract(const std::vector<Item> & items);
+
+	/**
+	* The *.raw files of dir/male (label 0), dir/female (label 1) and of dir itself (label -1),
+	* sorted by the name.
+	*/
+	static std::vector<Item> list_directory(const std::string & dir);
+
+	// A text file with a line "file [label]" per item, relative paths are relative to the working directory
+	static std::vector<Item> read_list(const std::string & file);
+
+	/**
+	* The feature file: a line per successfully processed file with its properties and its label,
+	* i.e. the format of voice_gender_data with only the properties VoiceProcessor computes,
+	* which VoiceRecognitionNet(file) trains from. Like voice_gender_data, the lines are shuffled
+	* (with a fixed seed, so the same results give the same file), because the network is tested on
+	* the last lines and the items usually come sorted by the label.
+	* Files with an unknown label are written with -1, which VoiceRecognitionNet does not accept.
+	*/
+	static void write(const std::string & file, const std::vector<Result> & results);
+
+private:
+	const static size_t plans_per_thread = 16; // lengths with a cached plan, the cache is dropped when full
+	const static unsigned shuffle_seed = 1; // of write()
+
+	struct ThreadState;
+
+	size_t sample_rate;
+	nn::WorkerPool pool;
+	std::vector<ThreadState> states;
+
+	void process(const Item & item, ThreadState & state, Result & result);
+};
+
+
+
+#endif
@@ -1,4 +1,5 @@
 #include "voice_processor.hpp"
+#include "spectrum.hpp"
 #include <armadillo>
 #include <string>
 #include <fstream>
@@ -7,6 +8,11 @@
 #include <array>
 #include <cmath>
 #include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 
 
@@ -17,16 +23,77 @@ VoiceProcessor::VoiceProcessor(const std::string & file, double sample_length /*
 
 	read_data(file);
 
-	compute_moment_properties();
-	compute_quantile_properties();
-	compute_spectral_entropy();
-	compute_centroid();
-	compute_spectral_flattness();
-	compute_mode();
+	compute_properties();
+}
 
-	
+VoiceProcessor::VoiceProcessor(arma::vec spectrum, double sample_length /* s */):
+	ft_data(std::move(spectrum)), sample_length(sample_length), sample_rate(0) {
 
+	if(ft_data.n_elem == 0) throw std::invalid_argument{"Empty spectrum."};
 
+	compute_properties();
+}
+
+/**
+* All the properties in two passes over the spectrum, without temporaries. The bins are the weights of
+* the frequencies 0, 1, 2, ... (in 1/sample_length Hz):
+* 1st pass - the sums of w, w*k (the mean and the centroid), w^2 and w^2*log(w) (the entropy of w^2/sum(w^2)
+*	is (log(sum w^2) - 2*sum(w^2*log w)/sum(w^2))/log(n)), log(w) (the flatness) and the maximum (the mode);
+* 2nd pass - the central moments for SD, skew and kurtosis and the quartiles, which need the sum.
+*/
+void VoiceProcessor::compute_properties(){
+	const double * const w = ft_data.memptr();
+	const size_t n = ft_data.n_elem;
+
+	double sum = 0, sum_k = 0, sum_sq = 0, sum_sq_log = 0, sum_log = 0;
+	size_t mode = 0;
+	for(size_t k = 0; k < n; ++k){
+		const double x = w[k], lg = std::log(x);
+		sum += x;
+		sum_k += x*k;
+		sum_sq += x*x;
+		sum_sq_log += x*x*lg;
+		sum_log += lg;
+		if(x > w[mode]) mode = k;
+	}
+
+	const double mean = sum_k/sum;
+
+	// The quartiles: the (linearly interpolated) index i at which the cumulative sum reaches the proportion
+	// of sum. Computed exactly as before, i.e. the remainder of a proportion at bin i > 0 is reduced
+	// by the bins 1..i, so that the properties stay comparable with the data computed by the previous versions.
+	const double proportion[3] = {0.25, 0.5, 0.75};
+	double rest[3], quartile[3] = {-1, -1, -1};
+	for(size_t q = 0; q < 3; ++q) rest[q] = proportion[q]*sum;
+	size_t found = 0;
+
+	double m2 = 0, m3 = 0, m4 = 0;
+	for(size_t k = 0; k < n; ++k){
+		const double x = w[k], d = k - mean, d2 = d*d;
+		m2 += x*d2;
+		m3 += x*d2*d;
+		m4 += x*d2*d2;
+
+		if(k > 0) for(size_t q = found; q < 3; ++q) rest[q] -= x;
+		for(; found < 3 && x >= rest[found]; ++found) quartile[found] = k + rest[found]/x;
+	}
+
+	const double variance = m2/sum, stdev = std::sqrt(variance);
+
+	properties[MEANFREQ] = to_khz(mean);
+	properties[CENTROID] = to_khz(mean);
+	properties[SD] = to_khz(stdev);
+	properties[SKEW] = m3/sum/(stdev*stdev*stdev);
+	properties[KURT] = m4/sum/(variance*variance);
+
+	properties[Q25] = to_khz(quartile[0]);
+	properties[MEDIAN] = to_khz(quartile[1]);
+	properties[Q75] = to_khz(quartile[2]);
+	properties[IQR] = to_khz(quartile[2] - quartile[0]);
+
+	properties[SPENT] = (std::log(sum_sq) - 2*sum_sq_log/sum_sq)/std::log((double)n);
+	properties[SFM] = n*std::exp(sum_log/n - std::log(sum));
+	properties[MODE] = to_khz(mode);
 }
 
 
@@ -43,118 +110,121 @@ void VoiceProcessor::read_data(const std::string & file){
 	in.close();
 
 
-	arma::vec v(len);
+	std::vector<double> v(len);
 
 	for(size_t i = 0; i < len; ++i){
-		v(i) = (double)buffer[i];
+		v[i] = (double)buffer[i];
 	}
 
 
-	arma::vec tmp = arma::abs(arma::fft(v));
-
-	// Cut only the lower 0..max_human_voice_frequency Hz;
-	ft_data = tmp.subvec(0, (size_t)std::ceil(max_human_voice_frequency*sample_length)); 
+	// Only the lower 0..max_human_voice_frequency Hz of the spectrum are computed (see spectrum.hpp)
+	nn::BandSpectrum spectrum(len, spectrum_bins(sample_length));
+	spectrum.magnitudes(v.data(), ft_data);
 }
 
 
+StreamingVoiceProcessor::StreamingVoiceProcessor(size_t sample_rate /* Hz */, Config config):
+	sample_rate(sample_rate), config(config) {
 
-// Computes the n_th moments of of_what where the probability distribution
-// is given by weights (just rescaling by denominator).
-double moment(arma::vec of_what, arma::vec & weights, double n_th, double denominator){
-	double numerator = arma::accu(weights % (of_what.transform([n_th] (auto x) { return std::pow(x, n_th); })));
-	return numerator/denominator;
-}
-
-double moment(arma::vec of_what, arma::vec & weights, double n_th){
-	return moment(std::move(of_what), weights, n_th, arma::accu(weights));
-}
-
-void VoiceProcessor::compute_moment_properties(){
-	double weight_sum = arma::accu(ft_data);
-
-	size_t n = ft_data.n_rows;
-
-	arma::vec freqs(n);
-	int imbue_cnt = 0;
-	freqs.imbue( [&imbue_cnt] () { return imbue_cnt++; });
-	// freqs = {0,1,2,3,...,n-1}
-
+	if(sample_rate < 2*VoiceProcessor::max_human_voice_frequency) throw std::invalid_argument{"Too low sample rate."};
 
-	// MEANFREQ
-	double meanf = moment(freqs, ft_data, 1, weight_sum);
+	window_len = (size_t)std::ceil(config.window*sample_rate);
+	hop_len = (size_t)std::ceil(config.hop*sample_rate);
+	if(window_len < 2 || hop_len == 0 || hop_len > window_len) throw std::invalid_argument{"Wrong window or hop length."};
+	if(config.segment < 0) throw std::invalid_argument{"Negative segment length."};
 
-	properties[MEANFREQ] = to_khz(meanf);
+	segment_windows = config.segment > 0 ? std::max<size_t>(1, (size_t)std::round(config.segment/config.hop)) : 0;
 
-	freqs.transform( [meanf] (auto x) { return x - meanf; }); // Normalize the frequencies for moment calculation
-
-	// STANDARD DEVIATION
-	double variance = moment(freqs, ft_data, 2, weight_sum);
-	double stdev = sqrt(variance);
-	properties[SD] = to_khz(stdev);
-
-	// SKEW
-	properties[SKEW] = moment(freqs, ft_data, 3, weight_sum)/(stdev*stdev*stdev);
-
-	// KURTOSIS
-	properties[KURT] = moment(freqs, ft_data, 4, weight_sum)/(variance*variance);
-
-
-}
-
-/**
-* Returns the (lineary interpolated) index i such that the cummulative sum of data up to i is exactly proportion
-* For example the median is get_proportion_i(data, sum*data)/2).
-*/
-double VoiceProcessor::get_proportion_i(arma::vec & data, double proportion){
-	size_t i = 0;
-	for(; i < data.n_rows && data(i) < proportion; ++i, proportion-=data(i));
-	if(i == data.n_rows)return -1;
-	return i + proportion/data(i);
-}
-
-void VoiceProcessor::compute_quantile_properties(){
-	double weight_sum = arma::accu(ft_data);
-	double q1 = get_proportion_i(ft_data, 0.25*weight_sum),
-		median = get_proportion_i(ft_data, 0.5*weight_sum),
-		q3 = get_proportion_i(ft_data, 0.75*weight_sum);
-	double iqr = q3-q1;
-
-	properties[Q25] = to_khz(q1);
-	properties[MEDIAN] = to_khz(median);
-	properties[Q75] = to_khz(q3);
-	properties[IQR] = to_khz(iqr);
+	// (Periodic) Hann window, so that the edges of the windows do not add high frequencies into the band;
+	// the same as nn::SlidingSpectrum::hann_magnitudes
+	const double pi = 3.14159265358979323846;
+	hann.resize(window_len);
+	for(size_t i = 0; i < window_len; ++i) hann[i] = 0.5 - 0.5*std::cos(2*pi*i/window_len);
 }
 
-void VoiceProcessor::compute_spectral_entropy(){
-	arma::vec p = (1/(double)ft_data.n_rows) * (ft_data % ft_data);
-	double sum = arma::accu(p);
-	properties[SPENT] = -arma::accu(p.transform( [sum] (auto x) {
-			double y = x/sum; return y*std::log(y);
-	}))/std::log((double)ft_data.n_rows);
-}
-
-
-void VoiceProcessor::compute_centroid(){
-	auto rel_amplitudes = ft_data / arma::accu(ft_data);
-
-	size_t n = ft_data.n_rows;
-
-	arma::vec freqs(n);
-	int imbue_cnt = 0;
-	freqs.imbue( [&imbue_cnt] () { return imbue_cnt++; });
-
-	properties[CENTROID] = to_khz(arma::accu(freqs % rel_amplitudes));
-}
+StreamingVoiceProcessor::Properties StreamingVoiceProcessor::process(const std::string & file,
+		std::function<void(double, const Properties &)> on_segment){
+
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if(fd < 0) throw std::runtime_error{"Cannot open the voice file " + file + "."};
+#ifdef POSIX_FADV_SEQUENTIAL
+	::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	const double window_s = (double)window_len/sample_rate, hop_s = (double)hop_len/sample_rate;
+	nn::BandSpectrum spectrum(window_len, VoiceProcessor::spectrum_bins(window_s));
+
+	std::vector<int16_t> chunk((size_t)chunk_samples); // a copy, the vector would bind (odr-use) the static member
+	std::vector<double> window(window_len), windowed(window_len);
+	size_t filled = 0; // samples in window
+	bool uncovered = false; // some samples in window are not in any processed window yet
+
+	arma::vec mag, total(spectrum.bins(), arma::fill::zeros), segment(spectrum.bins(), arma::fill::zeros);
+	size_t windows = 0, segment_n = 0, segment_first = 0;
+
+	auto emit_segment = [&] () {
+		if(segment_n && on_segment) on_segment(segment_first*hop_s, VoiceProcessor(segment/(double)segment_n, window_s).properties);
+		segment.zeros();
+		segment_n = 0;
+		segment_first = windows;
+	};
+
+	// The window is full (or zero-padded at the end of the file)
+	auto process_window = [&] () {
+		for(size_t i = 0; i < window_len; ++i) windowed[i] = window[i]*hann[i];
+		spectrum.magnitudes(windowed.data(), mag);
+
+		total += mag;
+		segment += mag;
+		++windows;
+		++segment_n;
+		uncovered = false;
+
+		if(segment_windows && segment_n == segment_windows) emit_segment();
+	};
+
+	try{
+		size_t carry = 0; // an odd byte from the previous read
+		while(true){
+			ssize_t r = ::read(fd, (char*)chunk.data() + carry, chunk_samples*sizeof(int16_t) - carry);
+			if(r < 0) throw std::runtime_error{"Cannot read the voice file " + file + "."};
+			if(r == 0) break;
+
+			size_t bytes = carry + (size_t)r, n = bytes/sizeof(int16_t);
+			for(size_t i = 0; i < n; ){
+				size_t k = std::min(n - i, window_len - filled);
+				std::copy(chunk.data() + i, chunk.data() + i + k, window.data() + filled);
+				filled += k;
+				i += k;
+				uncovered = true;
+
+				if(filled == window_len){
+					process_window();
+
+					// Slide by hop, the rest of the window stays for the next one
+					std::copy(window.begin() + hop_len, window.end(), window.begin());
+					filled = window_len - hop_len;
+				}
+			}
+
+			carry = bytes % sizeof(int16_t);
+			if(carry) ((char*)chunk.data())[0] = ((char*)chunk.data())[bytes - 1];
+		}
+	}
+	catch(...){
+		::close(fd);
+		throw;
+	}
+	::close(fd);
 
-void VoiceProcessor::compute_spectral_flattness(){
-	size_t n = ft_data.n_rows;
+	// The end of the file which did not fill a whole window
+	if(uncovered){
+		std::fill(window.begin() + filled, window.end(), 0.0);
+		process_window();
+	}
+	if(windows == 0) throw std::runtime_error{"Empty voice file " + file + "."};
 
-	arma::vec rel_amplitudes = ft_data / arma::accu(ft_data);
-	double lg = arma::accu(arma::log(rel_amplitudes));
-	properties[SFM] = n*std::exp(lg/n);
+	emit_segment();
 
+	return VoiceProcessor(total/(double)windows, window_s).properties;
 }
-
-void VoiceProcessor::compute_mode(){
-	properties[MODE] = to_khz(arma::index_max(ft_data));
-}
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <vector>
 #include <array>
 #include <cmath>
+#include <functional>
 
 
 class VoiceProcessor{
@@ -30,6 +31,17 @@ public:
 	*/
 	VoiceProcessor(const std::string & file, double sample_length /* s */, size_t sample_rate /* Hz */);
 
+	/**
+	* The properties of a given magnitude spectrum: bin i is i/sample_length Hz and there are
+	* the bins up to max_human_voice_frequency (e.g. an average of windows, see StreamingVoiceProcessor).
+	*/
+	VoiceProcessor(arma::vec spectrum, double sample_length /* s */);
+
+	// The number of the bins up to max_human_voice_frequency of a spectrum of a sample_length long signal
+	static size_t spectrum_bins(double sample_length /* s */){
+		return (size_t)std::ceil(max_human_voice_frequency*sample_length) + 1;
+	}
+
 private:
 	arma::vec ft_data; // Fourier transform of the raw sound data
 	double sample_length; // s
@@ -37,16 +49,7 @@ private:
 
 	void read_data(const std::string & file);
 
-
-
-	void compute_moment_properties();
-	void compute_quantile_properties();
-	void compute_spectral_entropy();
-	void compute_centroid();
-	void compute_spectral_flattness();
-	void compute_mode();
-
-	double get_proportion_i(arma::vec & data, double proportion);
+	void compute_properties();
 
 	// Frequency "given by" the Fourier transform
 	inline double to_khz(double freq){
@@ -57,4 +60,43 @@ private:
 
 
 
+/**
+* Usage: StreamingVoiceProcessor sp(44100, {window, hop, segment});
+* auto properties = sp.process(file, [] (double start, const std::array<double, property_cnt> & p) { ... });
+*
+* The same properties for recordings of any length in constant memory: the file (in the format of VoiceProcessor)
+* is read in chunks, the spectrum (up to max_human_voice_frequency) of every Hann-windowed window of
+* the given length is computed as it comes (the windows start hop seconds apart), the spectra are averaged
+* and the properties are computed from the average. The memory is one window and one chunk, regardless
+* of the length of the file.
+* With segment > 0, the properties of every segment of that many seconds (from the windows starting in it)
+* are also passed to the callback as soon as the segment is read.
+*/
+class StreamingVoiceProcessor{
+public:
+	const static size_t property_cnt = VoiceProcessor::property_cnt;
+	typedef std::array<double, property_cnt> Properties;
+
+	struct Config{
+		double window; // s
+		double hop; // s
+		double segment; // s, 0 - only the whole file
+	};
+
+	StreamingVoiceProcessor(size_t sample_rate /* Hz */, Config config = Config{1, 0.5, 0});
+
+	// The properties of the whole file, on_segment(start of the segment in s, its properties) for every segment
+	Properties process(const std::string & file, std::function<void(double, const Properties &)> on_segment = nullptr);
+
+private:
+	const static size_t chunk_samples = 1 << 16; // read at once
+
+	size_t sample_rate;
+	Config config;
+	size_t window_len, hop_len, segment_windows; // in samples, segment in windows (0 - none)
+	std::vector<double> hann;
+};
+
+
+
 #endif
\ No newline at end of file
@@ -4,12 +4,15 @@
 #include <armadillo>
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <iostream>
 #include <vector>
 #include <array>
 #include <cmath>
 #include <algorithm>
 #include <stdexcept>
+#include <memory>
+#include <chrono>
 
 
 
@@ -18,29 +21,16 @@ VoiceRecognitionNet::VoiceRecognitionNet(const std::string & data){
 	load_data(data);
 
 	gd.train( [this] (auto && n, size_t epoch_i) {
-		auto && res = n->feed_forward(test_data);
-		size_t ok_cnt = 0;
-
-		for(size_t i = 0; i < test_size; ++i){
-			size_t sex = 2;
-			double bst = -100000000;
-			for(size_t j = 0; j < num_of_sexes; ++j){
-				if(res(j, i) > bst){
-					bst = res(j, i);
-					sex = j;
-				}
-			}
-			if(sex == test_labels[i]){
-				++ok_cnt;
-			}
-		}
-
-		std::cout << "After epoch #"<<epoch_i<<" I classified "<< ok_cnt<<" / "<< test_size << std::endl;
+		evaluator->evaluate_async(*n, epoch_i, [] (const nn::EvaluationResult & r) {
+			std::cout << "After epoch #"<<r.epoch<<" I classified "<< r.correct<<" / "<< r.total << std::endl;
+		});
 
 		return false;
 	});
 
-	
+	evaluator->wait();
+
+	check_identify_voice();
 }
 
 
@@ -83,49 +73,75 @@ void VoiceRecognitionNet::save_weights(const std::string & weigths_file, const s
 
 
 
-std::pair<arma::mat, std::vector<size_t>> VoiceRecognitionNet::read_data(const std::string & f, size_t n){
+std::pair<arma::Mat<nn::real>, std::vector<size_t>> VoiceRecognitionNet::read_data(const std::string & f){
 	std::ifstream in(f);
+	if(!in) throw std::runtime_error{"Cannot open the voice data " + f + "."};
+
+	// The number of values per line tells the format: property_cnt_in_data or property_cnt properties and the label
+	std::string line;
+	size_t values = 0;
+	if(std::getline(in, line)){
+		std::istringstream ls(line);
+		double tmp;
+		while(ls >> tmp) ++values;
+	}
+	if(values != property_cnt_in_data + 1 && values != property_cnt + 1) throw std::runtime_error{"Bad voice data file " + f + "."};
 
-	arma::mat retmat(property_cnt, n);
-	std::vector<size_t> labels(n);
+	const size_t properties = values - 1;
+	in.clear();
+	in.seekg(0);
 
-	for(size_t i = 0; i < n; ++i){
+	std::vector<nn::real> props;
+	std::vector<size_t> labels;
 
-		auto && cl = retmat.col(i);
+	while(true){
 		double tmp;
+		if(!(in >> tmp)) break;
 
-		for(size_t j=0; j < property_cnt_in_data; ++j){
-			in >> tmp;
+		for(size_t j = 0; j < properties; ++j){
 			// I can not compute all properties in the data file, I can only compute first twelve of them
 			// hence it is necessary to ignore the rest of each line.
-			if(j < property_cnt)cl(j) = tmp;
+			if(j < property_cnt) props.push_back(tmp);
+			if(j + 1 < properties && !(in >> tmp)) throw std::runtime_error{"Bad voice data file " + f + "."};
 		}
-		in >> labels[i];
 
+		size_t label;
+		if(!(in >> label) || label >= num_of_sexes) throw std::runtime_error{"Bad label in the voice data file " + f + "."};
+		labels.push_back(label);
 	}
 
 	in.close();
 
 
+	arma::Mat<nn::real> retmat(props.data(), property_cnt, labels.size());
+
 	compute_normalization_parameters(retmat);
+	std::copy(retmat.colptr(0), retmat.colptr(0) + property_cnt, first_sample.begin());
+
 	normalize(retmat);
+	std::copy(retmat.colptr(0), retmat.colptr(0) + property_cnt, first_sample_normalized.begin());
 
 	return {std::move(retmat), std::move(labels)};
 }
 
 void VoiceRecognitionNet::load_data(const std::string & f){
 
-	auto raw = read_data(f, training_size+test_size);
+	auto raw = read_data(f);
+
+	const size_t n = raw.second.size();
+	const size_t test_n = (size_t)std::round((double)n*test_size/(training_size + test_size));
+	const size_t training_n = n - test_n;
+	if(training_n == 0 || test_n == 0) throw std::runtime_error{"Too few samples in the voice data " + f + "."};
 
 	// Training data first
 
 
-	std::array<arma::mat, 2> data;
-	data[0] = raw.first.submat(0, 0, property_cnt-1, training_size-1);
-	data[1].set_size(num_of_sexes, training_size);
+	std::array<arma::Mat<nn::real>, 2> data;
+	data[0] = raw.first.submat(0, 0, property_cnt-1, training_n-1);
+	data[1].set_size(num_of_sexes, training_n);
 
-	for(size_t i = 0; i < training_size; ++i){
-		arma::vec labels(num_of_sexes, arma::fill::zeros);
+	for(size_t i = 0; i < training_n; ++i){
+		arma::Col<nn::real> labels(num_of_sexes, arma::fill::zeros);
 		labels[raw.second[i]]=1.0;
 
 		data[1].col(i) = labels;
@@ -136,28 +152,28 @@ void VoiceRecognitionNet::load_data(const std::string & f){
 
 	// Then test data
 
-	test_data = raw.first.submat(0, training_size, property_cnt-1, raw.first.n_cols-1);
-	test_labels.resize(test_size);
+	test_data = raw.first.submat(0, training_n, property_cnt-1, raw.first.n_cols-1);
+	test_labels.assign(raw.second.begin()+training_n, raw.second.end());
 
-	std::copy(raw.second.begin()+training_size, raw.second.end(), test_labels.begin());
+	evaluator.reset(new nn::Evaluator<Net>(test_data, test_labels));
 
 }
 
 // We need inputs to be roughly from the interval [0,1]
 // z-score normalization seems to work better than [min,max] -> [0,1] normalization
-void VoiceRecognitionNet::compute_normalization_parameters(arma::mat & m){
+void VoiceRecognitionNet::compute_normalization_parameters(arma::Mat<nn::real> & m){
 	means.clear(); stddevs.clear();
 	means.resize(property_cnt); stddevs.resize(property_cnt);
 
-	arma::mat mean_mat = arma::mean(m, 1);
-	arma::mat stddev_mat = arma::stddev(m, 0, 1);
+	arma::Mat<nn::real> mean_mat = arma::mean(m, 1);
+	arma::Mat<nn::real> stddev_mat = arma::stddev(m, 0, 1);
 	for(size_t i = 0; i < property_cnt; ++i){
 		means[i] = mean_mat(i,0);
 		stddevs[i] = stddev_mat(i,0);
 	}
 }
 
-void VoiceRecognitionNet::normalize(arma::mat & m){
+void VoiceRecognitionNet::normalize(arma::Mat<nn::real> & m){
 
 	for(size_t i = 0; i < m.n_rows; ++i){
 
@@ -171,10 +187,54 @@ void VoiceRecognitionNet::normalize(arma::mat & m){
 }
 
 
+// The same for one sample, the properties are rounded to nn::real first like those read from the data
+std::array<nn::real, VoiceRecognitionNet::property_cnt> VoiceRecognitionNet::normalize(const std::array<double, property_cnt> & data) const {
+	std::array<nn::real, property_cnt> ret;
+
+	for(size_t i = 0; i < property_cnt; ++i){
+		double x = (nn::real)data[i];
+		ret[i] = 0.5 + (x-means[i])/(2*stddevs[i]);
+	}
+
+	return ret;
+}
+
+
 std::pair<double, double> VoiceRecognitionNet::identify_voice(const std::array<double, property_cnt> & data){
-	std::vector<double> v(data.begin(), data.end());
+	const std::array<nn::real, property_cnt> in = normalize(data);
+
+	if(queue){
+		nn::InferenceQueue<Net>::Input qin;
+		std::copy(in.begin(), in.end(), qin.begin());
+
+		auto res = queue->submit(qin).get();
+
+		return {res[0], res[1]};
+	}
+
+	auto res = gd.n.predict(in);
+
+	return {res[0], res[1]};
+}
+
+// A sample of the data classified by identify_voice (from its raw properties) has to get the same answer
+// as the trained network gives to it normalized, i.e. as it was trained
+void VoiceRecognitionNet::check_identify_voice(){
+	auto expected = gd.n.predict(first_sample_normalized);
+	auto res = identify_voice(first_sample);
+
+	if(res.first != expected[0] || res.second != expected[1]){
+		throw std::runtime_error{"identify_voice does not normalize its input as the training data."};
+	}
+}
+
+void VoiceRecognitionNet::enable_batching(size_t max_batch_size, std::chrono::microseconds max_delay){
+	queue.reset(); // finishes the requests of the old queue
+	queue.reset(new nn::InferenceQueue<Net>(gd.n, {max_batch_size, max_delay}));
+}
 
-	auto res = gd.n.feed_forward(std::vector<std::vector<double>>{v});
+nn::InferenceQueue<VoiceRecognitionNet::Net>::Stats VoiceRecognitionNet::batching_stats() const {
+	if(!queue) return nn::InferenceQueue<Net>::Stats{0, 0, 0, 0, 0};
 
-	return {res[0][0], res[0][1]};
-}
\ No newline at end of file
+	return queue->stats();
+}
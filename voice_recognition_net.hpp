@@ -3,6 +3,8 @@
 
 #include "neural_network.hpp"
 #include "gradient_descent.hpp"
+#include "inference_queue.hpp"
+#include "evaluator.hpp"
 #include <armadillo>
 #include <string>
 #include <fstream>
@@ -11,6 +13,8 @@
 #include <array>
 #include <cmath>
 #include <algorithm>
+#include <memory>
+#include <chrono>
 
 
 class VoiceRecognitionNet{
@@ -21,6 +25,13 @@ public:
 	const static size_t num_of_sexes = 2; // Output layer size of the neural network
 
 
+	/**
+	* Trains the network from data: a line per sample with its properties and the label (0 - male, 1 - female),
+	* either the 20 properties of voice_gender_data (only the first property_cnt are used) or just the property_cnt
+	* properties VoiceProcessor computes (a file written by VoiceFeatureExtractor). The samples are split into
+	* the training and the test part in the proportion of voice_gender_data (3000 : 168), the test part being
+	* the last lines, so the file has to be shuffled (both voice_gender_data and VoiceFeatureExtractor::write are).
+	*/
 	VoiceRecognitionNet(const std::string & data);
 
 	VoiceRecognitionNet(const std::string & saved_weights, const std::string & saved_normalization_parameters);
@@ -28,10 +39,23 @@ public:
 	void save_weights(const std::string & file, const std::string & normalization_parameters_file);
 
 	// .first - how certain the network is that the data correspond to a male voice, .second dtto for female
+	// The data are the raw properties (as computed by VoiceProcessor), they are normalized here.
+	// Can be called from more threads at once.
 	std::pair<double, double> identify_voice(const std::array<double, property_cnt> & data);
 
+	/**
+	* From now on, concurrent identify_voice calls are collected into batches of at most max_batch_size
+	* requests (waiting at most max_delay for the batch to fill) which are classified together.
+	*/
+	void enable_batching(size_t max_batch_size, std::chrono::microseconds max_delay);
+
+	// Latency percentiles and the achieved batch size, zeros if batching is not enabled
+	nn::InferenceQueue<nn::Network<property_cnt, 10, num_of_sexes>>::Stats batching_stats() const;
+
 private:
 
+	typedef nn::Network<property_cnt, 10, num_of_sexes> Net;
+
 	struct GradientDescentParams{
 		struct CostFunction : nn::CrossEntropyCostFunction{};
 		
@@ -43,8 +67,11 @@ private:
 	};
 
 
-	nn::GradientDescent<nn::Network<property_cnt, 10, num_of_sexes>, GradientDescentParams> gd;
+	nn::GradientDescent<Net, GradientDescentParams> gd;
+
+	std::unique_ptr<nn::InferenceQueue<Net>> queue;
 
+	// The split of voice_gender_data, other data are split in the same proportion
 	static const size_t training_size = 3000;
 	static const size_t test_size = 168;
 
@@ -52,17 +79,28 @@ private:
 	// this class needs to support teaching only from the first property_cnt properties.
 	static const size_t property_cnt_in_data = 20; 
 
-	arma::mat test_data;
+	arma::Mat<nn::real> test_data;
 	std::vector<size_t> test_labels;
 
+	// Evaluates the network after every epoch while the next one is trained
+	std::unique_ptr<nn::Evaluator<Net>> evaluator;
+
 	std::vector<double> means, stddevs; // for normalization
 
+	// The first sample of the data before and after the normalization, to check identify_voice after the training
+	std::array<double, property_cnt> first_sample;
+	std::array<nn::real, property_cnt> first_sample_normalized;
+
 
-	std::pair<arma::mat, std::vector<size_t>> read_data(const std::string & f, size_t n);
+	// All the samples of the file
+	std::pair<arma::Mat<nn::real>, std::vector<size_t>> read_data(const std::string & f);
 
 	void load_data(const std::string & f);
-	void compute_normalization_parameters(arma::mat & m);
-	void normalize(arma::mat & m);
+	void compute_normalization_parameters(arma::Mat<nn::real> & m);
+	void normalize(arma::Mat<nn::real> & m);
+	std::array<nn::real, property_cnt> normalize(const std::array<double, property_cnt> & data) const;
+
+	void check_identify_voice();
 
 };
 
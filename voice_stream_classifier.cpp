@@ -0,0 +1,106 @@
+#include "voice_stream_classifier.hpp"
+#include "voice_processor.hpp"
+#include "voice_recognition_net.hpp"
+#include <armadillo>
+#include <vector>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include <unistd.h>
+
+
+
+VoiceStreamClassifier::VoiceStreamClassifier(VoiceRecognitionNet & net, size_t sample_rate /* Hz */, Config config):
+	net(net), sample_rate(sample_rate), config(config),
+	window_len((size_t)std::ceil(config.window*sample_rate)),
+	hop_len((size_t)std::ceil(config.hop*sample_rate)),
+	window_s((double)window_len/sample_rate),
+	spectrum(std::max<size_t>(window_len, 2), VoiceProcessor::spectrum_bins(window_s)) {
+
+	if(sample_rate < 2*VoiceProcessor::max_human_voice_frequency) throw std::invalid_argument{"Too low sample rate."};
+	if(window_len < 2 || hop_len == 0 || hop_len > window_len) throw std::invalid_argument{"Wrong window or hop length."};
+	if(config.hop*1e6 >= config.latency_budget.count()) throw std::invalid_argument{"The hop is longer than the latency budget."};
+
+	latencies.reserve(latency_window);
+}
+
+
+void VoiceStreamClassifier::push(const int16_t * samples, size_t n, const std::function<void(const Decision &)> & on_decision){
+	const clock::time_point arrival = clock::now();
+
+	for(size_t i = 0; i < n; ){
+		if(in_hop == 0) hop_start = arrival;
+
+		size_t k = std::min(n - i, hop_len - in_hop);
+		spectrum.push(samples + i, k);
+		i += k;
+		in_hop += k;
+
+		if(in_hop == hop_len){
+			in_hop = 0;
+			if(spectrum.samples() >= window_len) decide(on_decision); // nothing until the first window is full
+		}
+	}
+}
+
+
+void VoiceStreamClassifier::run(int fd, const std::function<void(const Decision &)> & on_decision){
+	std::vector<int16_t> buffer((size_t)read_samples); // a copy, the vector would bind (odr-use) the static member
+	size_t carry = 0; // an odd byte from the previous read
+
+	while(true){
+		ssize_t r = ::read(fd, (char*)buffer.data() + carry, read_samples*sizeof(int16_t) - carry);
+		if(r < 0) throw std::runtime_error{"Cannot read the voice stream."};
+		if(r == 0) break;
+
+		size_t bytes = carry + (size_t)r;
+		push(buffer.data(), bytes/sizeof(int16_t), on_decision);
+
+		carry = bytes % sizeof(int16_t);
+		if(carry) ((char*)buffer.data())[0] = ((char*)buffer.data())[bytes - 1];
+	}
+}
+
+
+void VoiceStreamClassifier::decide(const std::function<void(const Decision &)> & on_decision){
+	spectrum.hann_magnitudes(magnitudes);
+
+	Decision d;
+	d.time = (double)spectrum.samples()/sample_rate;
+	d.weights = net.identify_voice(VoiceProcessor(magnitudes, window_s).properties);
+	d.latency = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - hop_start);
+
+	double us = (double)d.latency.count();
+	if(latencies.size() < latency_window) latencies.push_back(us);
+	else latencies[decisions % latency_window] = us;
+
+	++decisions;
+	if(d.latency > config.latency_budget) ++over_budget;
+	max_latency = std::max(max_latency, us);
+
+	if(on_decision) on_decision(d);
+}
+
+
+VoiceStreamClassifier::Stats VoiceStreamClassifier::stats() const {
+	std::vector<double> l = latencies;
+
+	auto percentile = [&l] (double p) {
+		if(l.empty()) return 0.0;
+
+		auto it = l.begin() + (size_t)(p*(l.size()-1));
+		std::nth_element(l.begin(), it, l.end());
+		return *it;
+	};
+
+	Stats ret;
+	ret.decisions = decisions;
+	ret.over_budget = over_budget;
+	ret.p50_latency_us = percentile(0.5);
+	ret.p99_latency_us = percentile(0.99);
+	ret.max_latency_us = max_latency;
+	return ret;
+}
@@ -0,0 +1,96 @@
+#ifndef _VOICE_STREAM_CLASSIFIER_HPP
+#define _VOICE_STREAM_CLASSIFIER_HPP
+
+#include "voice_processor.hpp"
+#include "voice_recognition_net.hpp"
+#include "spectrum.hpp"
+#include <armadillo>
+#include <vector>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+
+/**
+* Usage: VoiceStreamClassifier c(net, 44100, {window, hop, latency_budget});
+* c.run(0, [] (const VoiceStreamClassifier::Decision & d) { ... }); // reads stdin (or a pipe) until EOF
+* or c.push(samples, n, on_decision) with the samples as they come from anywhere else.
+*
+* Live classification of a 16-bit PCM stream (the format of VoiceProcessor): the 0..280 Hz spectrum of the
+* last window seconds is kept up to date by a sliding DFT (nn::SlidingSpectrum) with every sample, and every
+* hop seconds the properties are computed from it (Hann-windowed, as in StreamingVoiceProcessor) and
+* classified by the network. So at the end of a hop only the properties and one forward pass remain to be done.
+*
+* The latency of a decision is measured from the arrival (the push call or the read) of the first sample
+* of its hop to the decision, so when the samples come in real time it includes the hop itself.
+* The decisions over latency_budget are counted; the hop has to be shorter than the budget.
+*
+* One classifier per stream, they are independent (the network may be shared, identify_voice is thread-safe),
+* so a thread can serve many streams.
+*/
+
+
+class VoiceStreamClassifier{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	struct Config{
+		double window; // s
+		double hop; // s
+		std::chrono::microseconds latency_budget;
+	};
+
+	struct Decision{
+		double time; // s, the end of the classified window in the stream
+		std::pair<double, double> weights; // as returned by VoiceRecognitionNet::identify_voice
+		std::chrono::microseconds latency;
+	};
+
+	// Over the last latency_window decisions
+	struct Stats{
+		size_t decisions;
+		size_t over_budget; // all decisions
+		double p50_latency_us;
+		double p99_latency_us;
+		double max_latency_us;
+	};
+
+	const static size_t latency_window = 4096;
+
+	// net has to outlive the classifier
+	VoiceStreamClassifier(VoiceRecognitionNet & net, size_t sample_rate /* Hz */,
+		Config config = Config{1, 0.1, std::chrono::microseconds(200000)});
+
+	// Samples which have just arrived, on_decision is called for every hop they complete
+	void push(const int16_t * samples, size_t n, const std::function<void(const Decision &)> & on_decision);
+
+	// Reads the samples from the file descriptor (e.g. 0 for stdin) until EOF
+	void run(int fd, const std::function<void(const Decision &)> & on_decision);
+
+	Stats stats() const;
+
+private:
+	const static size_t read_samples = 1024; // at most per read, small for the latency
+
+	VoiceRecognitionNet & net;
+	size_t sample_rate;
+	Config config;
+	size_t window_len, hop_len;
+	double window_s;
+
+	nn::SlidingSpectrum spectrum;
+	arma::vec magnitudes;
+
+	size_t in_hop = 0; // samples of the current hop
+	clock::time_point hop_start; // the arrival of its first sample
+
+	std::vector<double> latencies; // ring buffer of the last latency_window latencies in us
+	size_t decisions = 0, over_budget = 0;
+	double max_latency = 0;
+
+	void decide(const std::function<void(const Decision &)> & on_decision);
+};
+
+
+#endif
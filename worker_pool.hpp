@@ -0,0 +1,216 @@
+#ifndef _WORKER_POOL_HPP
+#define _WORKER_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+
+
+/**
+* Usage: WorkerPool pool(threads);
+* pool.run([] (size_t thread_i) { ... }); // runs the function once on every thread and waits
+*
+* A fork-join pool of persistent threads, so that parallel sections can be
+* entered many times per second (e.g. once per minibatch) without creating threads.
+*
+* parallel_for(pool, n, [] (size_t i, size_t thread_i) { ... }); // items of uneven cost, see below
+*/
+
+
+namespace nn{
+
+class WorkerPool{
+public:
+	explicit WorkerPool(size_t threads = 1){
+		resize(threads);
+	}
+
+	~WorkerPool(){
+		stop();
+	}
+
+	WorkerPool(const WorkerPool &) = delete;
+	WorkerPool & operator=(const WorkerPool &) = delete;
+
+	// The number of threads including the calling one
+	size_t size() const {
+		return workers.size() + 1;
+	}
+
+	void resize(size_t threads){
+		threads = std::max<size_t>(threads, 1);
+		if(threads == size()) return;
+
+		stop();
+
+		size_t gen;
+		{
+			std::lock_guard<std::mutex> lock(m);
+			quit = false;
+			gen = generation;
+		}
+
+		// The new workers must wait for the next run, not take the job of the last one
+		for(size_t i = 1; i < threads; ++i){
+			workers.emplace_back([this, i, gen] () { worker_loop(i, gen); });
+		}
+	}
+
+	// Calls f(i) for every i = 0..size()-1, each on a different thread (i == 0 on the calling one),
+	// and waits until all of them finish. The first exception thrown by any f(i) is rethrown here.
+	template<typename F>
+	void run(F && f){
+		if(workers.empty()){
+			f(0);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m);
+			job = std::ref(f);
+			pending = workers.size();
+			error = nullptr;
+			++generation;
+		}
+		start_cv.notify_all();
+
+		std::exception_ptr own_error;
+		try{
+			f(0);
+		}
+		catch(...){
+			own_error = std::current_exception();
+		}
+
+		std::unique_lock<std::mutex> lock(m);
+		done_cv.wait(lock, [this] () { return pending == 0; });
+		job = nullptr;
+
+		if(own_error) std::rethrow_exception(own_error);
+		if(error) std::rethrow_exception(error);
+	}
+
+private:
+	std::vector<std::thread> workers;
+
+	std::mutex m;
+	std::condition_variable start_cv, done_cv;
+
+	std::function<void(size_t)> job;
+	size_t generation = 0;
+	size_t pending = 0;
+	bool quit = false;
+	std::exception_ptr error;
+
+	void worker_loop(size_t thread_i, size_t seen /* the generation of the last job */){
+		for(;;){
+			std::function<void(size_t)> f;
+			{
+				std::unique_lock<std::mutex> lock(m);
+				start_cv.wait(lock, [this, seen] () { return quit || generation != seen; });
+				if(quit) return;
+
+				seen = generation;
+				f = job;
+			}
+
+			std::exception_ptr e;
+			try{
+				f(thread_i);
+			}
+			catch(...){
+				e = std::current_exception();
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m);
+				if(e && !error) error = e;
+				if(--pending == 0) done_cv.notify_one();
+			}
+		}
+	}
+
+	void stop(){
+		{
+			std::lock_guard<std::mutex> lock(m);
+			quit = true;
+		}
+		start_cv.notify_all();
+
+		for(auto && t : workers) t.join();
+		workers.clear();
+	}
+};
+
+
+/**
+* Calls f(i, thread_i) for every i < n on the threads of pool, with work stealing: every thread starts
+* with its own contiguous range of the items and takes them from its front; a thread which runs out steals
+* the back half of the remaining items of another one. So items of very different costs (e.g. files of
+* different lengths) keep all the threads busy until the end, while each item is still taken only once
+* and a thread mostly works on neighbouring items.
+*/
+template<class F>
+void parallel_for(WorkerPool & pool, size_t n, F && f){
+	struct Range{
+		std::mutex m;
+		size_t begin, end;
+	};
+
+	const size_t threads = pool.size();
+	std::vector<Range> ranges(threads);
+	for(size_t t = 0; t < threads; ++t){
+		ranges[t].begin = t*n/threads;
+		ranges[t].end = (t+1)*n/threads;
+	}
+
+	pool.run([&] (size_t thread_i) {
+		Range & own = ranges[thread_i];
+
+		for(;;){
+			size_t i;
+			{
+				std::lock_guard<std::mutex> lock(own.m);
+				i = own.begin < own.end ? own.begin++ : n;
+			}
+
+			if(i == n){
+				// Steal from the thread with the most items left
+				size_t victim = threads, most = 0;
+				for(size_t t = 0; t < threads; ++t){
+					if(t == thread_i) continue;
+					std::lock_guard<std::mutex> lock(ranges[t].m);
+					if(ranges[t].end - ranges[t].begin > most){
+						most = ranges[t].end - ranges[t].begin;
+						victim = t;
+					}
+				}
+				if(victim == threads) return; // nothing left anywhere
+
+				{
+					std::lock_guard<std::mutex> lock(ranges[victim].m);
+					Range & v = ranges[victim];
+					size_t left = v.end - v.begin;
+					if(left == 0) continue; // taken in the meantime, look again
+
+					size_t take = (left + 1)/2;
+					std::lock_guard<std::mutex> own_lock(own.m);
+					own.begin = v.end - take;
+					own.end = v.end;
+					v.end -= take;
+				}
+				continue;
+			}
+
+			f(i, thread_i);
+		}
+	});
+}
+
+};
+
+#endif